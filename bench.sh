@@ -0,0 +1,102 @@
+#!/bin/sh
+# (C) 2012 Dave Vasilevsky <dave@vasilevsky.ca>
+# Licensing: GPL v2, see the COPYING file
+
+# Mounts each sample filesystem in turn, runs fsbench workloads against it,
+# and prints one line of JSON per workload. Run it with 'make bench'.
+#
+# Settings come from the environment:
+#   BENCH_TREE     A directory to copy, to crawl with dup_ll and tree_ll
+#                  (/usr/include)
+#   BENCH_SECS     Most seconds for each workload (10)
+#   BENCH_THREADS  Threads for the parallel workloads (4)
+#   BENCH_DATA     Size in MB of the file dup_ll and tree_ll read (256)
+#   BENCH_FS       Which filesystems to run
+#                  ("many many_ll big_ll dup_ll tree_ll")
+
+set -e
+
+tree=${BENCH_TREE:-/usr/include}
+secs=${BENCH_SECS:-10}
+threads=${BENCH_THREADS:-4}
+data_mb=${BENCH_DATA:-256}
+filesystems=${BENCH_FS:-many many_ll big_ll dup_ll tree_ll}
+
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d "${TMPDIR:-/tmp}/fuse-bench.XXXXXX")
+mnt=$work/mnt
+pid=
+
+cleanup() {
+	[ -n "$pid" ] && unmount
+	rm -rf "$work"
+}
+trap cleanup EXIT INT TERM
+
+# Start a filesystem in the background, and wait until it's mounted
+mount_fs() {
+	"$@" &
+	pid=$!
+	for i in $(seq 100); do
+		mountpoint -q "$mnt" && return 0
+		kill -0 $pid 2>/dev/null || break
+		sleep 0.1
+	done
+	echo "Couldn't mount: $*" >&2
+	exit 1
+}
+
+unmount() {
+	fusermount -u "$mnt"
+	wait $pid || true
+	pid=
+}
+
+run() {
+	"$here/fsbench" -l "$label" -d "$secs" "$@"
+}
+
+# The sources for dup_ll and tree_ll: a copy of BENCH_TREE, and a data file
+mkdir -p "$mnt" "$work/src"
+cp -r "$tree" "$work/src/tree"
+dd if=/dev/urandom of="$work/src/data" bs=1M count="$data_mb" 2>/dev/null
+
+for label in $filesystems; do
+	case $label in
+	many|many_ll)
+		mount_fs "$here/$label" "$mnt" -o fanout=100,depth=3,total=100000
+		run crawl "$mnt"
+		run ls "$mnt"
+		;;
+	big_ll)
+		mount_fs "$here/big_ll" "$mnt" -t "$threads" --gen random \
+			--files 1000 --dirs 10 --size 16G:4K
+		run crawl "$mnt"
+		run ls "$mnt"
+		run rand4k "$mnt/dir0/file000"
+		run -t "$threads" rand4k "$mnt/dir0/file000"
+		run seq1m "$mnt/dir0/file000"
+		run -t "$threads" parallel "$mnt/dir0/file000"
+		;;
+	dup_ll|tree_ll)
+		if [ $label = dup_ll ]; then
+			mount_fs "$here/dup_ll" "$work/src" "$mnt" -o threads="$threads"
+		else
+			"$here/tree_write" -c "$work/blob" "$work/src" "$work/image"
+			mount_fs "$here/tree_ll" "$work/image" "$mnt" \
+				-o blob="$work/blob"
+		fi
+		run crawl "$mnt/tree"
+		run ls "$mnt/tree"
+		run rand4k "$mnt/data"
+		run -t "$threads" rand4k "$mnt/data"
+		run seq1m "$mnt/data"
+		run -t "$threads" parallel "$mnt/data"
+		;;
+	*)
+		echo "Unknown filesystem: $label" >&2
+		exit 1
+		;;
+	esac
+	unmount
+done
@@ -0,0 +1,157 @@
+// (C) 2012 Dave Vasilevsky <dave@vasilevsky.ca>
+// Licensing: GPL v2, see the COPYING file
+
+// Contents of big_ll's files, shared with big_verify so it can check them.
+// Every byte is a function of its file's number and its offset alone, so
+// any range can be made, or checked, without looking at anything before it.
+//
+//   template   Each block is its ID, then the rest of the base block. The
+//              ID is the block's index, plus the file number shifted to
+//              the top bits.
+//   random     Pseudo-random, from the seed. Incompressible.
+//   compress   Each 4K chunk is random for 1/ratio of its length, then
+//              zeros, so it compresses about ratio:1
+//   sparse     Random, except every other block is all zeros
+
+#ifndef BIG_GEN_H
+#define BIG_GEN_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "parse_size.h"
+
+enum { GEN_TEMPLATE, GEN_RANDOM, GEN_COMPRESS, GEN_SPARSE };
+
+#define GEN_CHUNK 4096
+
+typedef struct {
+	int kind;
+	const char *base;	// Template: the base block
+	off_t block_size;
+	uint64_t seed;
+	unsigned ratio;		// Compress: how compressible
+} big_gen;
+
+static const char *big_gen_names[] = { "template", "random", "compress",
+	"sparse", NULL };
+
+// The kind of generator with a name, or -1 if there's none
+static int big_gen_kind(const char *name) {
+	int i;
+	for (i = 0; big_gen_names[i]; ++i)
+		if (strcmp(name, big_gen_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+// The random word at a word index, a splitmix64 hash of it. Words are
+// independent, so compilers vectorize the loop in gen_random where the target
+// has 64-bit vector multiplies, like AVX-512; elsewhere it stays scalar. See
+// the README for how fast it is.
+static inline uint64_t gen_word(uint64_t seed, uint64_t w) {
+	uint64_t z = seed + w * 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+// Random bytes for a range
+static void gen_random(uint64_t seed, off_t off, size_t size, char *dst) {
+	uint64_t w = off / sizeof(uint64_t), v;
+	size_t skip = off % sizeof(uint64_t), n;
+
+	if (skip) {	// Partial first word
+		v = gen_word(seed, w++);
+		n = sizeof(v) - skip;
+		if (n > size)
+			n = size;
+		memcpy(dst, (char*)&v + skip, n);
+		dst += n;
+		size -= n;
+	}
+	for (; size >= sizeof(v); dst += sizeof(v), size -= sizeof(v)) {
+		v = gen_word(seed, w++);
+		memcpy(dst, &v, sizeof(v));
+	}
+	if (size) {	// Partial last word
+		v = gen_word(seed, w);
+		memcpy(dst, &v, size);
+	}
+}
+
+// The ID a template block starts with
+static inline uint64_t big_gen_block_id(uint64_t file, uint64_t block) {
+	return block + (file << 40);
+}
+
+// The seed for a file's random bytes
+static inline uint64_t gen_seed(const big_gen *g, uint64_t file) {
+	return g->seed + file * 0xd1b54a32d192ed03ULL;
+}
+
+// Part of one template block
+static void gen_template(const big_gen *g, uint64_t i, off_t start,
+		size_t take, char *dst) {
+	memcpy(dst, g->base + start, take);
+	if ((size_t)start < sizeof(i)) {
+		size_t n = sizeof(i) - start;
+		memcpy(dst, (char*)&i + start, take < n ? take : n);
+	}
+}
+
+// Whether a block is all zeros
+static int big_gen_hole(const big_gen *g, uint64_t block) {
+	return g->kind == GEN_SPARSE && (block & 1);
+}
+
+// Fill a buffer with the contents of a range of a file
+static void big_gen_fill(const big_gen *g, uint64_t file, off_t off,
+		size_t size, char *dst) {
+	uint64_t seed = gen_seed(g, file);
+	while (size) {
+		off_t unit = g->kind == GEN_COMPRESS ? GEN_CHUNK : g->block_size;
+		uint64_t idx = off / unit;
+		off_t start = off % unit;
+		off_t avail = unit - start;
+		size_t take = size > (size_t)avail ? (size_t)avail : size;
+
+		switch (g->kind) {
+		case GEN_TEMPLATE:
+			gen_template(g, big_gen_block_id(file, idx), start, take, dst);
+			break;
+		case GEN_RANDOM:
+			gen_random(seed, off, take, dst);
+			break;
+		case GEN_COMPRESS: {
+			off_t random = GEN_CHUNK / g->ratio;
+			if (start < random) {
+				size_t n = (size_t)(random - start) < take
+					? (size_t)(random - start) : take;
+				gen_random(seed, off, n, dst);
+				memset(dst + n, 0, take - n);
+			} else {
+				memset(dst, 0, take);
+			}
+			break;
+		}
+		case GEN_SPARSE:
+			if (big_gen_hole(g, idx))
+				memset(dst, 0, take);
+			else
+				gen_random(seed, off, take, dst);
+			break;
+		}
+
+		off += take;
+		size -= take;
+		dst += take;
+	}
+}
+
+#endif
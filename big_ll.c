@@ -10,33 +10,138 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <assert.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <ctype.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#include "loop.h"
+#include "throttle.h"
+#include "stats.h"
+#include "big_gen.h"
 
 typedef struct {
-	char *basebuf;
-	off_t block_size, total_size;
+	big_gen gen;		// Shared by all threads, never written
+	uint64_t nfiles, ndirs;
+	off_t *sizes;		// File sizes, repeated over all the files
+	size_t nsizes;
+	int file_width, dir_width;	// Digits in names
+	pthread_key_t arena;	// Each thread's reply buffer
 } big_ctx;
 
-static const char *hello_str = "Hello World!\n";
+#define min(x, y) ((x) < (y) ? (x) : (y))
+
+// Scratch space for building replies, kept by each thread and reused
+typedef struct {
+	char *buf;		// Data copied for a reply
+	size_t size;
+	struct iovec *iov;	// Segments of a reply
+	uint64_t *idx;		// Block indices, for segments to point at
+	size_t nblocks;
+} big_arena;
+
+// Most segments we'll hand to fuse_reply_iov(), which adds one of its own.
+// Any more and writev() would refuse them.
+#define MAX_SEGS (IOV_MAX - 1)
+
+// The tree is a root, holding ndirs directories if there are any, or else
+// all the files. The files are split evenly between the directories, in
+// order, and the first nfiles % ndirs directories get one more. A lone file
+// at the root keeps its old name, "hello".
+//
+// Inode 1 is the root, the directories follow, then the files.
 static const char *hello_name = "hello";
 
-static int hello_stat(fuse_ino_t ino, struct stat *stbuf, off_t total_size)
+static fuse_ino_t dir_ino(big_ctx *ctx, uint64_t d) {
+	return 2 + d;
+}
+
+static fuse_ino_t file_ino(big_ctx *ctx, uint64_t f) {
+	return 2 + ctx->ndirs + f;
+}
+
+// Whether an inode is the root or a directory, and which directory
+static int ino_dir(big_ctx *ctx, fuse_ino_t ino, uint64_t *d) {
+	if (ino < 2 || ino >= 2 + ctx->ndirs)
+		return 0;
+	*d = ino - 2;
+	return 1;
+}
+
+// Whether an inode is a file, and which one
+static int ino_file(big_ctx *ctx, fuse_ino_t ino, uint64_t *f) {
+	if (ino < 2 + ctx->ndirs || ino - 2 - ctx->ndirs >= ctx->nfiles)
+		return 0;
+	*f = ino - 2 - ctx->ndirs;
+	return 1;
+}
+
+static off_t file_size(big_ctx *ctx, uint64_t f) {
+	return ctx->sizes[f % ctx->nsizes];
+}
+
+// The files in a directory, or the root
+static void dir_files(big_ctx *ctx, fuse_ino_t ino, uint64_t *first,
+		uint64_t *count) {
+	uint64_t d, per, extra;
+	
+	*first = *count = 0;
+	if (ino == 1) {
+		if (!ctx->ndirs)
+			*count = ctx->nfiles;
+	} else if (ino_dir(ctx, ino, &d)) {
+		per = ctx->nfiles / ctx->ndirs;
+		extra = ctx->nfiles % ctx->ndirs;
+		*first = d * per + min(d, extra);
+		*count = per + (d < extra);
+	}
+}
+
+static void entry_name(big_ctx *ctx, int is_dir, uint64_t i, char *buf,
+		size_t size) {
+	if (is_dir)
+		snprintf(buf, size, "dir%0*llu", ctx->dir_width, (unsigned long long)i);
+	else if (ctx->nfiles == 1 && !ctx->ndirs)
+		snprintf(buf, size, "%s", hello_name);
+	else
+		snprintf(buf, size, "file%0*llu", ctx->file_width,
+			 (unsigned long long)i);
+}
+
+// Parse an entry name, returning its number or -1
+static int64_t entry_parse(const char *name, const char *prefix, int width) {
+	size_t plen = strlen(prefix);
+	char *end;
+	long long i;
+	
+	if (strncmp(name, prefix, plen) != 0)
+		return -1;
+	name += plen;
+	if (strlen(name) != width || !isdigit((unsigned char)*name))
+		return -1;
+	i = strtoll(name, &end, 10);
+	return *end ? -1 : i;
+}
+
+static int big_stat(big_ctx *ctx, fuse_ino_t ino, struct stat *stbuf)
 {
+	uint64_t n;
+	
+	memset(stbuf, 0, sizeof(*stbuf));
 	stbuf->st_ino = ino;
-	switch (ino) {
-	case 1:
+	if (ino == 1 || ino_dir(ctx, ino, &n)) {
 		stbuf->st_mode = S_IFDIR | 0755;
 		stbuf->st_nlink = 2;
-		break;
-
-	case 2:
+	} else if (ino_file(ctx, ino, &n)) {
 		stbuf->st_mode = S_IFREG | 0444;
 		stbuf->st_nlink = 1;
-		stbuf->st_size = total_size;
-		break;
-
-	default:
+		stbuf->st_size = file_size(ctx, n);
+	} else {
 		return -1;
 	}
 	return 0;
@@ -50,8 +155,7 @@ static void big_ll_getattr(fuse_req_t req, fuse_ino_t ino,
 	
 	(void) fi;
 
-	memset(&stbuf, 0, sizeof(stbuf));
-	if (hello_stat(ino, &stbuf, ctx->total_size) == -1)
+	if (big_stat(ctx, ino, &stbuf) == -1)
 		fuse_reply_err(req, ENOENT);
 	else
 		fuse_reply_attr(req, &stbuf, 1.0);
@@ -61,73 +165,103 @@ static void big_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
 	struct fuse_entry_param e;
 	big_ctx *ctx = (big_ctx*)fuse_req_userdata(req);
+	uint64_t first, count;
+	int64_t i;
+
+	memset(&e, 0, sizeof(e));
+	if (parent != 1 && !ino_dir(ctx, parent, &first)) {
+		fuse_reply_err(req, ino_file(ctx, parent, &first) ? ENOTDIR : ENOENT);
+		return;
+	}
+	dir_files(ctx, parent, &first, &count);
+	if (parent == 1 && ctx->ndirs) {
+		i = entry_parse(name, "dir", ctx->dir_width);
+		if (i >= 0 && i < ctx->ndirs)
+			e.ino = dir_ino(ctx, i);
+	} else if (parent == 1 && ctx->nfiles == 1 && !ctx->ndirs) {
+		if (strcmp(name, hello_name) == 0)
+			e.ino = file_ino(ctx, 0);
+	} else {
+		i = entry_parse(name, "file", ctx->file_width);
+		if (i >= (int64_t)first && i < first + count)
+			e.ino = file_ino(ctx, i);
+	}
 
-	if (parent != 1 || strcmp(name, hello_name) != 0)
+	if (!e.ino)
 		fuse_reply_err(req, ENOENT);
 	else {
-		memset(&e, 0, sizeof(e));
-		e.ino = 2;
 		e.attr_timeout = 1.0;
 		e.entry_timeout = 1.0;
-		hello_stat(e.ino, &e.attr, ctx->total_size);
+		big_stat(ctx, e.ino, &e.attr);
 
 		fuse_reply_entry(req, &e);
 	}
 }
 
-struct dirbuf {
-	char *p;
-	size_t size;
-};
-
-static void dirbuf_add(fuse_req_t req, struct dirbuf *b, const char *name,
-		       fuse_ino_t ino)
-{
-	struct stat stbuf;
-	size_t oldsize = b->size;
-	b->size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
-	b->p = (char *) realloc(b->p, b->size);
-	memset(&stbuf, 0, sizeof(stbuf));
-	stbuf.st_ino = ino;
-	fuse_add_direntry(req, b->p + oldsize, b->size - oldsize, name, &stbuf,
-			  b->size);
-}
-
-#define min(x, y) ((x) < (y) ? (x) : (y))
-
-static int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
-			     off_t off, size_t maxsize)
-{
-	if (off < bufsize)
-		return fuse_reply_buf(req, buf + off,
-				      min(bufsize - off, maxsize));
-	else
-		return fuse_reply_buf(req, NULL, 0);
-}
-
+// Offsets are indices: 0 is ".", 1 is "..", and the rest are children, so
+// a listing can resume anywhere without building what comes before.
 static void big_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 			     off_t off, struct fuse_file_info *fi)
 {
+	big_ctx *ctx = (big_ctx*)fuse_req_userdata(req);
+	uint64_t d, first, count;
+	int subdirs = ino == 1 && ctx->ndirs;
+	char *buf;
+	size_t used = 0;
+
 	(void) fi;
 
-	if (ino != 1)
+	if (ino != 1 && !ino_dir(ctx, ino, &d)) {
 		fuse_reply_err(req, ENOTDIR);
-	else {
-		struct dirbuf b;
-
-		memset(&b, 0, sizeof(b));
-		dirbuf_add(req, &b, ".", 1);
-		dirbuf_add(req, &b, "..", 1);
-		dirbuf_add(req, &b, hello_name, 2);
-		reply_buf_limited(req, b.p, b.size, off, size);
-		free(b.p);
+		return;
+	}
+	if (!(buf = malloc(size))) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	dir_files(ctx, ino, &first, &count);
+	if (subdirs)
+		count = ctx->ndirs;
+
+	for (; off < count + 2; ++off) {
+		struct stat stbuf;
+		char name[32];
+		size_t sz;
+
+		memset(&stbuf, 0, sizeof(stbuf));
+		if (off < 2) {
+			strcpy(name, off ? ".." : ".");
+			stbuf.st_ino = off ? 1 : ino;
+			stbuf.st_mode = S_IFDIR;
+		} else if (subdirs) {
+			entry_name(ctx, 1, off - 2, name, sizeof(name));
+			stbuf.st_ino = dir_ino(ctx, off - 2);
+			stbuf.st_mode = S_IFDIR;
+		} else {
+			entry_name(ctx, 0, first + off - 2, name, sizeof(name));
+			stbuf.st_ino = file_ino(ctx, first + off - 2);
+			stbuf.st_mode = S_IFREG;
+		}
+
+		sz = fuse_add_direntry(req, buf + used, size - used, name,
+				       &stbuf, off + 1);
+		if (sz > size - used)
+			break;
+		used += sz;
 	}
+
+	stats_reply(used);
+	fuse_reply_buf(req, buf, used);
+	free(buf);
 }
 
 static void big_ll_open(fuse_req_t req, fuse_ino_t ino,
 			  struct fuse_file_info *fi)
 {
-	if (ino != 2)
+	big_ctx *ctx = (big_ctx*)fuse_req_userdata(req);
+	uint64_t f;
+
+	if (!ino_file(ctx, ino, &f))
 		fuse_reply_err(req, EISDIR);
 	else if ((fi->flags & 3) != O_RDONLY)
 		fuse_reply_err(req, EACCES);
@@ -135,95 +269,145 @@ static void big_ll_open(fuse_req_t req, fuse_ino_t ino,
 		fuse_reply_open(req, fi);
 }
 
-// Get the data of one block
-static char *get_block(big_ctx *ctx, uint64_t i) {
-	char *buf = ctx->basebuf;
+// This thread's scratch space
+static big_arena *arena_get(big_ctx *ctx) {
+	big_arena *a = pthread_getspecific(ctx->arena);
 	
-	// Make it different from other blocks, to defeat any dedup
-	*(uint64_t*)buf = i;
+	if (!a) {
+		if (!(a = calloc(1, sizeof(*a))))
+			return NULL;
+		pthread_setspecific(ctx->arena, a);
+	}
+	return a;
+}
+
+// Make room for a copy of size bytes
+static char *arena_buf(big_arena *a, size_t size) {
+	if (a->size < size) {
+		free(a->buf);
+		a->size = 0;
+		if (!(a->buf = malloc(size)))
+			return NULL;
+		a->size = size;
+	}
+	return a->buf;
+}
+
+// Make room for the segments of nblocks blocks
+static int arena_iov(big_arena *a, size_t nblocks) {
+	if (a->nblocks < nblocks) {
+		free(a->iov);
+		free(a->idx);
+		a->nblocks = 0;
+		a->iov = malloc(2 * nblocks * sizeof(*a->iov));
+		a->idx = malloc(nblocks * sizeof(*a->idx));
+		if (!a->iov || !a->idx)
+			return -1;
+		a->nblocks = nblocks;
+	}
+	return 0;
+}
+
+static void arena_free(void *p) {
+	big_arena *a = p;
+	free(a->buf);
+	free(a->iov);
+	free(a->idx);
+	free(a);
+}
+
+// Reply with segments pointing into the base block, so no data is copied.
+// Each block is its index, then the rest of the base.
+static void reply_iov(fuse_req_t req, big_ctx *ctx, big_arena *a,
+		uint64_t file, size_t nblocks, off_t off, size_t size) {
+	int nseg = 0;
+	size_t k, total = size;
+	
+	if (arena_iov(a, nblocks) == -1) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	
+	for (k = 0; size; ++k) {
+		off_t start = off % ctx->gen.block_size;
+		off_t avail = ctx->gen.block_size - start;
+		size_t take = size > avail ? avail : size;
+		size_t head = 0;
+		
+		a->idx[k] = big_gen_block_id(file, off / ctx->gen.block_size);
+		if (start < sizeof(a->idx[k])) {
+			head = sizeof(a->idx[k]) - start;
+			if (head > take)
+				head = take;
+			a->iov[nseg].iov_base = (char*)&a->idx[k] + start;
+			a->iov[nseg++].iov_len = head;
+		}
+		if (take > head) {
+			a->iov[nseg].iov_base = (char*)ctx->gen.base + start + head;
+			a->iov[nseg++].iov_len = take - head;
+		}
+		
+		off += take;
+		size -= take;
+	}
 	
-	return buf;
+	stats_reply(total);
+	fuse_reply_iov(req, a->iov, nseg);
+}
+
+// Reply with a copy. Needed for generated content, and for reads spanning
+// too many blocks to send as segments.
+static void reply_copy(fuse_req_t req, big_ctx *ctx, big_arena *a,
+		uint64_t file, off_t off, size_t size) {
+	char *buf;
+	
+	if (!(buf = arena_buf(a, size))) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	big_gen_fill(&ctx->gen, file, off, size, buf);
+	stats_reply(size);
+	fuse_reply_buf(req, buf, size);
 }
 
 static void big_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 			  off_t off, struct fuse_file_info *fi)
 {
-	char *buf, *pos;
 	big_ctx *ctx;
-	size_t remain;
+	big_arena *a;
+	size_t nblocks;
+	uint64_t file;
+	off_t total_size;
 	
 	(void) fi;
-	assert(ino == 2);
 	
 	ctx = (big_ctx*)fuse_req_userdata(req);
+	if (!ino_file(ctx, ino, &file)) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+	total_size = file_size(ctx, file);
 	
-	if (off > ctx->total_size)
-		off = ctx->total_size;
-	if (size > ctx->total_size - off)
-		size = ctx->total_size - off;
+	if (off > total_size)
+		off = total_size;
+	if (size > total_size - off)
+		size = total_size - off;
 	if (size == 0) {
 		fuse_reply_buf(req, NULL, 0);
 		return;
 	}
 	
-	
-	if (!(buf = malloc(size))) {
+	if (!(a = arena_get(ctx))) {
 		fuse_reply_err(req, ENOMEM);
 		return;
 	}
 	
-	remain = size;
-	pos = buf;
-	while (remain) {
-		char *block;
-		
-		uint64_t block_idx = off / ctx->block_size;
-		off_t start = off % ctx->block_size;
-		
-		off_t avail = ctx->block_size - start;		
-		size_t take = remain > avail ? avail : remain;
-		
-		block = get_block(ctx, block_idx);
-		memcpy(pos, block + start, take);
-		
-		off += take;
-		remain -= take;
-		pos += take;
-	}
-	
-	fuse_reply_buf(req, buf, size);
-	free(buf);
-}
-
-static off_t parse_size(char *sizespec, char *dflt) {
-	long long ret;
-	char *endptr;
-	size_t slen;
-	
-	if (!sizespec)
-		sizespec = dflt;
-	
-	errno = 0;
-	ret = strtoll(sizespec, &endptr, 10);
-	
-	if (endptr != sizespec && errno == 0) {
-		slen = strlen(endptr);
-		if (slen == 0)
-			return ret;
-		if (slen == 1 || (slen == 2 || tolower(endptr[1]) == 'b')) {
-			char *sufs = "kmgtp";
-			char c = tolower(endptr[0]);
-			char *suf = strchr(sufs, c);
-			if (suf) {
-				for (; suf >= sufs; --suf)
-					ret *= 1024;
-				return ret;
-			}
-		}
-	}
-
-	fprintf(stderr, "Size parse error: %s\n", sizespec);
-	exit(-2);	
+	nblocks = (off + size - 1) / ctx->gen.block_size
+		- off / ctx->gen.block_size + 1;
+	if (ctx->gen.kind == GEN_TEMPLATE && 2 * nblocks <= MAX_SEGS)
+		reply_iov(req, ctx, a, file, nblocks, off, size);
+	else
+		reply_copy(req, ctx, a, file, off, size);
 }
 
 static struct fuse_lowlevel_ops big_ll_oper = {
@@ -236,15 +420,47 @@ static struct fuse_lowlevel_ops big_ll_oper = {
 
 
 typedef struct {
-	char *base, *block_size_str, *total_size_str;
+	char *base, *block_size_str, *total_size_str, *gen;
+	unsigned threads, ratio;
+	unsigned long long seed, files, dirs;
 } big_opts;
 
+// Parse a list of sizes, separated by colons
+static void parse_sizes(big_ctx *ctx, const char *spec) {
+	char *list = strdup(spec ? spec : "1T"), *tok, *save;
+	
+	ctx->nsizes = 0;
+	ctx->sizes = NULL;
+	for (tok = strtok_r(list, ":", &save); tok;
+			tok = strtok_r(NULL, ":", &save)) {
+		ctx->sizes = realloc(ctx->sizes, (ctx->nsizes + 1) * sizeof(off_t));
+		if (!ctx->sizes) {
+			fprintf(stderr, "Out of mem\n");
+			exit(-1);
+		}
+		ctx->sizes[ctx->nsizes++] = parse_size(tok, NULL);
+	}
+	if (!ctx->nsizes) {
+		fprintf(stderr, "Size parse error: %s\n", spec);
+		exit(-2);
+	}
+	free(list);
+}
+
+// Digits needed to write any number below n
+static int digits(uint64_t n) {
+	char buf[32];
+	return snprintf(buf, sizeof(buf), "%llu",
+			(unsigned long long)(n ? n - 1 : 0));
+}
+
 int main(int argc, char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	struct fuse_chan *ch;
 	char *mountpoint;
 	big_ctx ctx;
+	char *basebuf;
 	int err = -1;
 	
 	struct fuse_opt optlist[] = {
@@ -254,19 +470,58 @@ int main(int argc, char *argv[])
 		{ "-b %s", offsetof(big_opts, block_size_str), 0 },
 		{ "--size %s", offsetof(big_opts, total_size_str), 0 },
 		{ "-s %s", offsetof(big_opts, total_size_str), 0 },
+		{ "--threads %u", offsetof(big_opts, threads), 0 },
+		{ "-t %u", offsetof(big_opts, threads), 0 },
+		{ "--gen %s", offsetof(big_opts, gen), 0 },
+		{ "-g %s", offsetof(big_opts, gen), 0 },
+		{ "--seed %llu", offsetof(big_opts, seed), 0 },
+		{ "--ratio %u", offsetof(big_opts, ratio), 0 },
+		{ "--files %llu", offsetof(big_opts, files), 0 },
+		{ "--dirs %llu", offsetof(big_opts, dirs), 0 },
+		FUSE_OPT_END
 	};
-	big_opts opts = { NULL, NULL, NULL };	
+	big_opts opts = { NULL, NULL, NULL, NULL, 1, 2, 0, 1, 0 };	
 	
 	if (fuse_opt_parse(&args, &opts, optlist, NULL) == -1) {
 		fprintf(stderr, "Bad opts\n");
 		exit(-2);
 	}
+	throttle_init(&args);
+	stats_init(&args, NULL);
 	
-	ctx.block_size = parse_size(opts.block_size_str, "128K");
-	ctx.total_size = parse_size(opts.total_size_str, "1T");
+	ctx.gen.block_size = parse_size(opts.block_size_str, "128K");
+	parse_sizes(&ctx, opts.total_size_str);
+	ctx.nfiles = opts.files;
+	ctx.ndirs = opts.dirs;
+	ctx.file_width = digits(ctx.nfiles);
+	ctx.dir_width = digits(ctx.ndirs);
+	if (ctx.nfiles < 1 || ctx.nfiles >= (1ULL << 24)
+			|| ctx.ndirs > ctx.nfiles) {
+		fprintf(stderr, "Bad number of files or directories\n");
+		exit(-2);
+	}
+	ctx.gen.seed = opts.seed;
+	ctx.gen.ratio = opts.ratio;
+	ctx.gen.kind = opts.gen ? big_gen_kind(opts.gen) : GEN_TEMPLATE;
+	if (ctx.gen.kind == -1) {
+		fprintf(stderr, "Unknown generator: %s\n", opts.gen);
+		exit(-2);
+	}
+	if (ctx.gen.ratio < 1 || ctx.gen.ratio > GEN_CHUNK) {
+		fprintf(stderr, "Bad ratio\n");
+		exit(-2);
+	}
+	if (ctx.gen.block_size < sizeof(uint64_t)) {
+		fprintf(stderr, "Block size too small\n");
+		exit(-2);
+	}
+	if (pthread_key_create(&ctx.arena, arena_free) != 0) {
+		fprintf(stderr, "Can't create thread key\n");
+		exit(-1);
+	}
 	
 	// Initialize our block data
-	if (!(ctx.basebuf = calloc(1, ctx.block_size))) {
+	if (!(basebuf = calloc(1, ctx.gen.block_size))) {
 		fprintf(stderr, "Out of mem\n");
 		exit(-1);
 	}
@@ -276,22 +531,25 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "Can't open base file\n");
 			exit(-1);
 		}
-		if (read(fd, ctx.basebuf, ctx.block_size) <= 0) {
+		if (read(fd, basebuf, ctx.gen.block_size) <= 0) {
 			fprintf(stderr, "Bad read\n");
 			exit(-1);
 		}
 	}	
+	ctx.gen.base = basebuf;
 	
 	if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) != -1 &&
 	    (ch = fuse_mount(mountpoint, &args)) != NULL) {
 		struct fuse_session *se;
 
-		se = fuse_lowlevel_new(&args, &big_ll_oper,
+		se = fuse_lowlevel_new(&args,
+				       throttle_ops(stats_ops(&big_ll_oper), opts.threads),
 				       sizeof(big_ll_oper), &ctx);
 		if (se != NULL && fuse_daemonize(1) != -1) {
 			if (fuse_set_signal_handlers(se) != -1) {
 				fuse_session_add_chan(se, ch);
-				err = fuse_session_loop(se);
+				err = session_loop_threads(se, opts.threads);
+				throttle_stop();
 				fuse_remove_signal_handlers(se);
 				fuse_session_remove_chan(ch);
 			}
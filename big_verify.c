@@ -0,0 +1,125 @@
+// (C) 2012 Dave Vasilevsky <dave@vasilevsky.ca>
+// Licensing: GPL v2, see the COPYING file
+
+// Checks that a range of a file read from big_ll has the contents it should.
+// The options must match the ones big_ll was mounted with, and --file must
+// give the file's number: the N in its name fileN.
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "big_gen.h"
+
+#define CHUNK (1024 * 1024)
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [OPTIONS] FILE [OFFSET [LENGTH]]\n"
+		"  -g, --gen GEN         Generator: template, random, compress, "
+			"sparse\n"
+		"  -b, --block-size SIZE Block size (128K)\n"
+		"  -c, --content FILE    Base block, for template\n"
+		"      --seed N          Seed (0)\n"
+		"      --ratio N         Compression ratio, for compress (2)\n"
+		"  -f, --file N          Number of the file being checked (0)\n",
+		prog);
+	exit(-2);
+}
+
+static void die(const char *msg) {
+	perror(msg);
+	exit(-2);
+}
+
+int main(int argc, char *argv[]) {
+	static struct option longopts[] = {
+		{ "gen", required_argument, NULL, 'g' },
+		{ "block-size", required_argument, NULL, 'b' },
+		{ "content", required_argument, NULL, 'c' },
+		{ "seed", required_argument, NULL, 's' },
+		{ "ratio", required_argument, NULL, 'r' },
+		{ "file", required_argument, NULL, 'f' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *block_size_str = NULL, *content = NULL;
+	big_gen gen = { GEN_TEMPLATE, NULL, 0, 0, 2 };
+	char *want, *got, *base;
+	off_t off = 0, len = -1, done = 0;
+	uint64_t file = 0;
+	int opt, fd;
+
+	while ((opt = getopt_long(argc, argv, "g:b:c:f:", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'g':
+			if ((gen.kind = big_gen_kind(optarg)) == -1)
+				usage(argv[0]);
+			break;
+		case 'b': block_size_str = optarg; break;
+		case 'c': content = optarg; break;
+		case 's': gen.seed = strtoull(optarg, NULL, 10); break;
+		case 'r': gen.ratio = strtoul(optarg, NULL, 10); break;
+		case 'f': file = strtoull(optarg, NULL, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind == argc || argc - optind > 3)
+		usage(argv[0]);
+	if (argc - optind > 1)
+		off = parse_size(argv[optind + 1], NULL);
+	if (argc - optind > 2)
+		len = parse_size(argv[optind + 2], NULL);
+	gen.block_size = parse_size(block_size_str, "128K");
+	if (gen.block_size < (off_t)sizeof(uint64_t) || gen.ratio < 1
+			|| gen.ratio > GEN_CHUNK)
+		usage(argv[0]);
+
+	// The base block, as big_ll sets it up
+	if (!(base = calloc(1, gen.block_size)))
+		die("calloc");
+	if (content) {
+		if ((fd = open(content, O_RDONLY)) == -1)
+			die(content);
+		if (read(fd, base, gen.block_size) <= 0)
+			die(content);
+		close(fd);
+	}
+	gen.base = base;
+
+	if ((fd = open(argv[optind], O_RDONLY)) == -1)
+		die(argv[optind]);
+	if (!(want = malloc(CHUNK)) || !(got = malloc(CHUNK)))
+		die("malloc");
+
+	while (len == -1 || done < len) {
+		size_t size = CHUNK, i;
+		ssize_t r;
+		if (len != -1 && len - done < (off_t)size)
+			size = len - done;
+		if ((r = pread(fd, got, size, off + done)) == -1)
+			die("read");
+		if (r == 0)
+			break;
+
+		big_gen_fill(&gen, file, off + done, r, want);
+		if (memcmp(got, want, r) != 0) {
+			for (i = 0; got[i] == want[i]; ++i)
+				;
+			printf("Mismatch at offset %lld\n", (long long)(off + done + i));
+			return 1;
+		}
+		done += r;
+	}
+	if (len != -1 && done < len) {
+		printf("File ends at offset %lld\n", (long long)(off + done));
+		return 1;
+	}
+
+	printf("%lld bytes OK\n", (long long)done);
+	return 0;
+}
@@ -5,6 +5,9 @@
 
 #include <fuse_lowlevel.h>
 
+#include "loop.h"
+#include "stats.h"
+
 #include <cstdio>
 #include <cstdlib>
 #include <cfloat>
@@ -13,13 +16,16 @@
 #include <cstring>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
-#include <string>
 #include <map>
 #include <vector>
 using std::vector;
-using std::string;
 using std::map;
 
 
@@ -29,42 +35,128 @@ static void die(const char *msg) {
 }
 
 
+// Where each inode we've handed out lives, as an O_PATH descriptor, so we
+// never have to resolve a whole path again. Requests may come in on many
+// threads at once, so the table is split into shards with their own locks.
+//
+// The kernel holds a reference for every lookup we answer, and tells us
+// with forget when it drops them. An inode is evicted once nobody holds it.
+class inode_table {
+  enum { shards = 64 };
+  struct inode {
+    inode() : fd(-1), nlookup(0) { }
+    int fd;
+    uint64_t nlookup;
+  };
+  typedef map<fuse_ino_t, inode> ino_map;
+  struct shard {
+    pthread_mutex_t lock;
+    ino_map inodes;
+  } shard_[shards];
+  unsigned long resident_;
+  
+  shard& shard_for(fuse_ino_t ino) {
+    return shard_[(ino ^ (ino >> 6) ^ (ino >> 12)) % shards];
+  }
+  
+public:
+  inode_table() : resident_(0) {
+    for (int i = 0; i < shards; ++i)
+      pthread_mutex_init(&shard_[i].lock, NULL);
+  }
+  ~inode_table() {
+    for (int i = 0; i < shards; ++i)
+      pthread_mutex_destroy(&shard_[i].lock);
+  }
+  
+  // How many inodes are in the table
+  unsigned long resident() {
+    return __sync_fetch_and_add(&resident_, 0);
+  }
+  
+  // The kernel won't forget an inode while a request on it is in flight,
+  // so the descriptor stays valid for the rest of the request.
+  int find(fuse_ino_t ino) {
+    shard& s = shard_for(ino);
+    pthread_mutex_lock(&s.lock);
+    ino_map::const_iterator iter = s.inodes.find(ino);
+    int fd = iter == s.inodes.end() ? -1 : iter->second.fd;
+    pthread_mutex_unlock(&s.lock);
+    return fd;
+  }
+  
+  // Record a lookup of an inode. Takes ownership of the descriptor.
+  void insert(fuse_ino_t ino, int fd) {
+    shard& s = shard_for(ino);
+    pthread_mutex_lock(&s.lock);
+    inode& i = s.inodes[ino];
+    if (i.nlookup++ == 0) {
+      __sync_fetch_and_add(&resident_, 1);
+      i.fd = fd;
+    } else {
+      close(fd);
+    }
+    pthread_mutex_unlock(&s.lock);
+  }
+  
+  void forget(fuse_ino_t ino, uint64_t nlookup) {
+    shard& s = shard_for(ino);
+    pthread_mutex_lock(&s.lock);
+    ino_map::iterator iter = s.inodes.find(ino);
+    if (iter != s.inodes.end()) {
+      inode& i = iter->second;
+      i.nlookup -= nlookup < i.nlookup ? nlookup : i.nlookup;
+      if (i.nlookup == 0) {
+        close(i.fd);
+        s.inodes.erase(iter);
+        __sync_fetch_and_sub(&resident_, 1);
+      }
+    }
+    pthread_mutex_unlock(&s.lock);
+  }
+};
+
 struct dup_ll {
-  dup_ll() : base(0), mountpoint(0) { }
+  dup_ll() : base(0), mountpoint(0), threads(0), root(-1) { }
   const char *base;
   const char *mountpoint;
+  unsigned threads;
   
-  typedef map<fuse_ino_t, string> ino_map;
-  ino_map inodes;
+  int root;
+  inode_table inodes;
   
-  string locate(fuse_ino_t ino) {
+  int locate(fuse_ino_t ino) {
     if (ino == FUSE_ROOT_ID)
-      return base;
-    ino_map::const_iterator iter = inodes.find(ino);
-    if (iter == inodes.end())
-      return NULL;
-    return iter->second;
+      return root;
+    return inodes.find(ino);
   }
 };
 
-static string locate(fuse_req_t req, fuse_ino_t ino) {
+static int locate(fuse_req_t req, fuse_ino_t ino) {
   dup_ll* dup = (dup_ll*)fuse_req_userdata(req);
   return dup->locate(ino);
 }
 
-static int dup_stat(string& p, struct stat *st) {
-  int r = lstat(p.c_str(), st);
+static int dup_stat(int fd, struct stat *st) {
+  int r = fstatat(fd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
   if (r != 0)
     return r;
   st->st_dev = 0;
   return r;
 }
 
+// Open an inode for real. An O_PATH descriptor can't be reopened with
+// openat(), but it can through /proc.
+static int reopen(int fd, int flags) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  return open(path, flags);
+}
+
 static void dup_ll_getattr(fuse_req_t req, fuse_ino_t ino,
     struct fuse_file_info *fi) {
-  string p = locate(req, ino);
   struct stat st;
-  if (dup_stat(p, &st) != 0) {
+  if (dup_stat(locate(req, ino), &st) != 0) {
     fuse_reply_err(req, errno);
     return;
   }
@@ -73,58 +165,115 @@ static void dup_ll_getattr(fuse_req_t req, fuse_ino_t ino,
 }
 
 static void dup_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
-  string p = locate(req, parent);
-  string c = p + "/" + name;
+  int fd = openat(locate(req, parent), name, O_PATH | O_NOFOLLOW);
+  if (fd == -1) {
+    fuse_reply_err(req, errno);
+    return;
+  }
   
   struct fuse_entry_param e;
   memset(&e, 0, sizeof(e));
   e.attr_timeout = e.entry_timeout = DBL_MAX;
-  if (dup_stat(c, &e.attr) != 0) {
+  if (dup_stat(fd, &e.attr) != 0) {
     fuse_reply_err(req, errno);
+    close(fd);
     return;
   }
   e.ino = e.attr.st_ino;
   
   dup_ll* dup = (dup_ll*)fuse_req_userdata(req);
-  dup->inodes[e.ino] = c;
+  dup->inodes.insert(e.ino, fd);
   fuse_reply_entry(req, &e);
 }
 
+static void dup_ll_forget(fuse_req_t req, fuse_ino_t ino,
+    unsigned long nlookup) {
+  dup_ll* dup = (dup_ll*)fuse_req_userdata(req);
+  dup->inodes.forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+#if FUSE_VERSION >= 29
+static void dup_ll_forget_multi(fuse_req_t req, size_t count,
+    struct fuse_forget_data *forgets) {
+  dup_ll* dup = (dup_ll*)fuse_req_userdata(req);
+  for (size_t i = 0; i < count; ++i)
+    dup->inodes.forget(forgets[i].ino, forgets[i].nlookup);
+  fuse_reply_none(req);
+}
+#endif
+
+// An open directory. Entries are handed out in batches, so we remember our
+// position, and any entry that didn't fit in the last reply.
+struct dirhandle {
+  dirhandle(DIR *d) : dp(d), offset(0), entry(NULL) { }
+  DIR *dp;
+  off_t offset;
+  struct dirent *entry;
+  vector<char> buf;
+};
+
 static void dup_ll_opendir(fuse_req_t req, fuse_ino_t ino,
     struct fuse_file_info *fi) {
-  string p = locate(req, ino);
-  DIR *d = opendir(p.c_str());
+  int fd = openat(locate(req, ino), ".", O_RDONLY | O_DIRECTORY);
+  DIR *d = fd == -1 ? NULL : fdopendir(fd);
   if (!d) {
     fuse_reply_err(req, errno);
+    if (fd != -1)
+      close(fd);
     return;
   }
-  fi->fh = (intptr_t)d;
+  fi->fh = (intptr_t)new dirhandle(d);
   fuse_reply_open(req, fi);
 }
 
 static void dup_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
     struct fuse_file_info *fi) {
-  closedir((DIR*)fi->fh);
+  dirhandle *dh = (dirhandle*)fi->fh;
+  closedir(dh->dp);
+  delete dh;
   fuse_reply_err(req, 0);
 }
 
 static void dup_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
     off_t off, struct fuse_file_info *fi) {
-  DIR *d = (DIR*)fi->fh;
-  struct dirent *de = readdir(d);
-  if (!de) {
-    fuse_reply_buf(req, NULL, 0);
-    return;
+  dirhandle *dh = (dirhandle*)fi->fh;
+  if (off != dh->offset) {
+    seekdir(dh->dp, off);
+    dh->offset = off;
+    dh->entry = NULL;
   }
   
-  struct stat st;
-  memset(&st, 0, sizeof(st));
-  st.st_ino = de->d_ino;
-  
-  size_t sz = fuse_add_direntry(req, NULL, 0, de->d_name, NULL, 0);
-  vector<char> buf(sz);
-  fuse_add_direntry(req, &buf[0], sz, de->d_name, &st, off + sz);
-  fuse_reply_buf(req, &buf[0], sz);
+  dh->buf.resize(size);
+  size_t used = 0;
+  while (true) {
+    if (!dh->entry) {
+      errno = 0;
+      if (!(dh->entry = readdir(dh->dp))) {
+        if (errno && !used) {
+          fuse_reply_err(req, errno);
+          return;
+        }
+        break;
+      }
+    }
+    
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_ino = dh->entry->d_ino;
+    st.st_mode = DTTOIF(dh->entry->d_type);
+    off_t next = telldir(dh->dp);
+    size_t sz = fuse_add_direntry(req, &dh->buf[used], size - used,
+      dh->entry->d_name, &st, next);
+    if (sz > size - used)
+      break;
+    
+    used += sz;
+    dh->offset = next;
+    dh->entry = NULL;
+  }
+  stats_reply(used);
+  fuse_reply_buf(req, &dh->buf[0], used);
 }
 
 static void dup_ll_open(fuse_req_t req, fuse_ino_t ino,
@@ -134,8 +283,7 @@ static void dup_ll_open(fuse_req_t req, fuse_ino_t ino,
     return;
   }
   
-  string p = locate(req, ino);
-  if ((fi->fh = open(p.c_str(), fi->flags)) == -1) {
+  if ((fi->fh = reopen(locate(req, ino), fi->flags)) == -1) {
     fuse_reply_err(req, errno);
     return;
   }
@@ -150,18 +298,69 @@ static void dup_ll_release(fuse_req_t req, fuse_ino_t ino,
 
 static void dup_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
     off_t off, struct fuse_file_info *fi) {
+#if FUSE_VERSION >= 29
+  // Point libfuse at the file, so it can splice the data straight from the
+  // page cache to the device
+  struct fuse_bufvec buf;
+  memset(&buf, 0, sizeof(buf));
+  buf.count = 1;
+  buf.buf[0].size = size;
+  buf.buf[0].flags = (fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+  buf.buf[0].fd = fi->fh;
+  buf.buf[0].pos = off;
+  stats_reply(size); // At most; we don't know how much is really there
+  fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+#else
   vector<char> buf(size);
   ssize_t r = pread(fi->fh, &buf[0], size, off);
   if (r == -1) {
     fuse_reply_err(req, errno);
     return;
   }
+  stats_reply(r);
   fuse_reply_buf(req, &buf[0], r);
+#endif
+}
+
+static void dup_ll_init(void *userdata, struct fuse_conn_info *conn) {
+#if FUSE_VERSION >= 29
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#endif
 }
 
+// We keep a descriptor for each inode the kernel knows about, so allow as
+// many as we can.
+static void raise_fd_limit() {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+// Stats reports include how many inodes we're holding on to
+static dup_ll *report_dup;
+
+static void report_resident(FILE *out) {
+  fprintf(out, "%lu inodes resident\n", report_dup->inodes.resident());
+}
+
+enum {
+  KEY_THREADS,
+};
+
+static struct fuse_opt dup_ll_opts[] = {
+  FUSE_OPT_KEY("threads=", KEY_THREADS),
+  FUSE_OPT_END
+};
+
 static int dup_ll_opt_proc(void *data, const char *arg, int key,
 		struct fuse_args *outargs) {
 	dup_ll *dup = (dup_ll*)data;
+	if (key == KEY_THREADS) {
+		dup->threads = strtoul(arg + strlen("threads="), NULL, 10);
+		return 0;
+	}
 	if (key == FUSE_OPT_KEY_NONOPT) {
 		if (dup->mountpoint) {
 			return -1; // Too many args
@@ -170,6 +369,8 @@ static int dup_ll_opt_proc(void *data, const char *arg, int key,
 			return 1;
 		} else {
 			dup->base = realpath(arg, NULL);
+			if (!dup->base || (dup->root = open(dup->base, O_PATH)) == -1)
+				return -1;
 			return 0;
 		}
 	}
@@ -179,7 +380,12 @@ static int dup_ll_opt_proc(void *data, const char *arg, int key,
 int main(int argc, char *argv[]) {
 	struct fuse_lowlevel_ops ops;
 	memset(&ops, 0, sizeof(ops));
+	ops.init		= dup_ll_init;
 	ops.lookup		= dup_ll_lookup;
+	ops.forget		= dup_ll_forget;
+#if FUSE_VERSION >= 29
+	ops.forget_multi	= dup_ll_forget_multi;
+#endif
 	ops.getattr	= dup_ll_getattr;
 	ops.opendir	= dup_ll_opendir;
 	ops.readdir	= dup_ll_readdir;
@@ -194,18 +400,23 @@ int main(int argc, char *argv[]) {
 	int err = -1;
 
 	dup_ll ll;
-  if (fuse_opt_parse(&args, &ll, NULL, dup_ll_opt_proc) == -1)
+  if (fuse_opt_parse(&args, &ll, dup_ll_opts, dup_ll_opt_proc) == -1)
     die("bad opts");
+  if (ll.root == -1)
+    die("no directory to mirror");
+  raise_fd_limit();
+  report_dup = &ll;
+  stats_init(&args, report_resident);
   
   if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) != -1 &&
 	    (ch = fuse_mount(mountpoint, &args)) != NULL) {
 		struct fuse_session *se;
 
-    se = fuse_lowlevel_new(&args, &ops, sizeof(ops), &ll);
+    se = fuse_lowlevel_new(&args, stats_ops(&ops), sizeof(ops), &ll);
 		if (se != NULL) {
 			if (fuse_set_signal_handlers(se) != -1) {
 				fuse_session_add_chan(se, ch);
-				err = fuse_session_loop(se);
+				err = session_loop_threads(se, ll.threads);
 				fuse_remove_signal_handlers(se);
 				fuse_session_remove_chan(ch);
 			}
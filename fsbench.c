@@ -0,0 +1,274 @@
+// (C) 2012 Dave Vasilevsky <dave@vasilevsky.ca>
+// Licensing: GPL v2, see the COPYING file
+
+// Runs one workload against a mounted filesystem, and prints a line of JSON
+// about how it went. See bench.sh, which runs them all.
+//
+//   crawl PATH      Walk a tree, stat'ing everything, like find
+//   ls PATH         Walk a tree doing what ls -lR does for each entry
+//   rand4k FILE     Read 4K blocks at random offsets
+//   seq1m FILE      Read 1M blocks in order
+//   parallel FILE   Like seq1m, with each thread reading its own part
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { W_CRAWL, W_LS, W_RAND4K, W_SEQ1M, W_PARALLEL };
+static const char *workloads[] = { "crawl", "ls", "rand4k", "seq1m",
+	"parallel", NULL };
+
+static int workload = -1;
+static const char *path, *label = "";
+static unsigned threads = 1;
+static uint64_t max_ops = 100000;	// Per thread
+static double max_secs = 10, deadline;
+static int direct;
+
+// What each thread did
+struct run {
+	unsigned id;
+	uint64_t *lat;	// Each operation's latency, in nanoseconds
+	size_t nops, cap;
+	uint64_t bytes;
+	off_t start, end;	// The part of the file to read
+	int fd;
+};
+
+static void die(const char *msg) {
+	perror(msg);
+	exit(1);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Note an operation. Returns zero when it's time to stop.
+static int record(struct run *r, uint64_t start, uint64_t bytes) {
+	if (r->nops == r->cap) {
+		r->cap = r->cap ? 2 * r->cap : 4096;
+		if (!(r->lat = realloc(r->lat, r->cap * sizeof(*r->lat))))
+			die("realloc");
+	}
+	r->lat[r->nops++] = now_ns() - start;
+	r->bytes += bytes;
+	return r->nops < max_ops && now() < deadline;
+}
+
+// Walk a directory and everything below it, recording an operation for each
+// entry. Returns zero once it's time to stop.
+static int walk(struct run *r, int dfd, int ls) {
+	DIR *dp = fdopendir(dfd);
+	struct dirent *de;
+	int go = 1;
+
+	if (!dp)
+		die("fdopendir");
+	while (go && (de = readdir(dp))) {
+		struct stat st;
+		uint64_t start;
+		char buf[256];
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		start = now_ns();
+		if (fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+			continue;
+		if (ls) {	// What coreutils ls -l asks about, beyond stat
+			char p[PATH_MAX];
+			snprintf(p, sizeof(p), "/proc/self/fd/%d/%s", dirfd(dp),
+				de->d_name);
+			lgetxattr(p, "security.selinux", buf, sizeof(buf));
+			lgetxattr(p, "system.posix_acl_access", buf, sizeof(buf));
+			if (S_ISLNK(st.st_mode))
+				readlinkat(dirfd(dp), de->d_name, buf, sizeof(buf));
+		}
+		go = record(r, start, 0);
+
+		if (go && S_ISDIR(st.st_mode)) {
+			int fd = openat(dirfd(dp), de->d_name,
+				O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (fd != -1)
+				go = walk(r, fd, ls);
+		}
+	}
+	closedir(dp);
+	return go;
+}
+
+static uint64_t rng_next(uint64_t *s) {
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static void *reader(void *arg) {
+	struct run *r = arg;
+	size_t bs = workload == W_RAND4K ? 4096 : 1024 * 1024;
+	uint64_t seed = 0x9e3779b97f4a7c15ULL * (r->id + 1);
+	uint64_t blocks = (r->end - r->start) / bs;
+	char *buf;
+	off_t off = r->start;
+
+	if (posix_memalign((void **) &buf, 4096, bs) != 0)
+		die("posix_memalign");
+	if (!blocks)
+		blocks = 1;
+	for (;;) {
+		uint64_t start;
+		ssize_t n;
+
+		if (workload == W_RAND4K)
+			off = r->start + rng_next(&seed) % blocks * bs;
+		else if (off >= r->end)
+			off = r->start;	// Go round again
+
+		start = now_ns();
+		if ((n = pread(r->fd, buf, bs, off)) == -1)
+			die("pread");
+		off += bs;
+		if (!record(r, start, n))
+			break;
+	}
+	free(buf);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static double pct(const uint64_t *lat, size_t n, double p) {
+	size_t i = n * p;
+	if (!n)
+		return 0;
+	return lat[i < n ? i : n - 1] / 1000.0;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [OPTIONS] WORKLOAD PATH\n"
+		"  -l, --label NAME  Name to report for the filesystem\n"
+		"  -t, --threads N   Threads, for rand4k and parallel (1)\n"
+		"  -n, --ops N       Most operations per thread (100000)\n"
+		"  -d, --secs S      Most seconds to run (10)\n"
+		"      --direct      Read with O_DIRECT, bypassing the page cache\n"
+		"Workloads: crawl, ls, rand4k, seq1m, parallel\n", prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	static struct option longopts[] = {
+		{ "label", required_argument, NULL, 'l' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "ops", required_argument, NULL, 'n' },
+		{ "secs", required_argument, NULL, 'd' },
+		{ "direct", no_argument, NULL, 'D' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct run *runs;
+	pthread_t *tids;
+	uint64_t *all, bytes = 0;
+	size_t nops = 0, n;
+	double began, secs;
+	unsigned i;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "l:t:n:d:", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'l': label = optarg; break;
+		case 't': threads = strtoul(optarg, NULL, 10); break;
+		case 'n': max_ops = strtoull(optarg, NULL, 10); break;
+		case 'd': max_secs = strtod(optarg, NULL); break;
+		case 'D': direct = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2 || threads < 1)
+		usage(argv[0]);
+	for (i = 0; workloads[i]; ++i)
+		if (strcmp(argv[optind], workloads[i]) == 0)
+			workload = i;
+	if (workload == -1)
+		usage(argv[0]);
+	path = argv[optind + 1];
+	if (workload == W_CRAWL || workload == W_LS || workload == W_SEQ1M)
+		threads = 1;
+
+	if (!(runs = calloc(threads, sizeof(*runs)))
+			|| !(tids = calloc(threads, sizeof(*tids))))
+		die("calloc");
+	began = now();
+	deadline = began + max_secs;
+
+	if (workload == W_CRAWL || workload == W_LS) {
+		int fd = open(path, O_RDONLY | O_DIRECTORY);
+		if (fd == -1)
+			die(path);
+		walk(&runs[0], fd, workload == W_LS);
+	} else {
+		struct stat st;
+		int fd = open(path, O_RDONLY | (direct ? O_DIRECT : 0));
+		if (fd == -1 || fstat(fd, &st) != 0)
+			die(path);
+		// Start cold, as far as we can
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		for (i = 0; i < threads; ++i) {
+			runs[i].id = i;
+			runs[i].fd = fd;
+			runs[i].end = st.st_size;
+			if (workload == W_PARALLEL) {
+				runs[i].start = st.st_size / threads * i;
+				runs[i].end = st.st_size / threads * (i + 1);
+			}
+			if (pthread_create(&tids[i], NULL, reader, &runs[i]) != 0)
+				die("pthread_create");
+		}
+		for (i = 0; i < threads; ++i)
+			pthread_join(tids[i], NULL);
+	}
+	secs = now() - began;
+
+	for (i = 0; i < threads; ++i)
+		nops += runs[i].nops;
+	if (!(all = malloc((nops ? nops : 1) * sizeof(*all))))
+		die("malloc");
+	for (i = 0, n = 0; i < threads; ++i) {
+		memcpy(all + n, runs[i].lat, runs[i].nops * sizeof(*all));
+		n += runs[i].nops;
+		bytes += runs[i].bytes;
+	}
+	qsort(all, nops, sizeof(*all), cmp_u64);
+
+	printf("{\"fs\": \"%s\", \"workload\": \"%s\", \"threads\": %u, "
+		"\"ops\": %zu, \"secs\": %.3f, \"ops_per_sec\": %.1f, "
+		"\"mb_per_sec\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+		"\"p999_us\": %.1f}\n", label, workloads[workload], threads, nops,
+		secs, nops / secs, bytes / secs / (1024 * 1024), pct(all, nops, 0.5),
+		pct(all, nops, 0.99), pct(all, nops, 0.999));
+	return 0;
+}
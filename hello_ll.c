@@ -19,6 +19,8 @@
 #include <unistd.h>
 #include <assert.h>
 
+#include "stats.h"
+
 static const char *hello_str = "Hello World!\n";
 static const char *hello_name = "hello";
 
@@ -102,11 +104,14 @@ static void dirbuf_add(fuse_req_t req, struct dirbuf *b, const char *name,
 static int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
 			     off_t off, size_t maxsize)
 {
-	if (off < bufsize)
+	if (off < bufsize) {
+		stats_reply(min(bufsize - off, maxsize));
 		return fuse_reply_buf(req, buf + off,
 				      min(bufsize - off, maxsize));
-	else
+	} else {
+		stats_reply(0);
 		return fuse_reply_buf(req, NULL, 0);
+	}
 }
 
 static void hello_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
@@ -163,11 +168,12 @@ int main(int argc, char *argv[])
 	char *mountpoint;
 	int err = -1;
 
+	stats_init(&args, NULL);
 	if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) != -1 &&
 	    (ch = fuse_mount(mountpoint, &args)) != NULL) {
 		struct fuse_session *se;
 
-		se = fuse_lowlevel_new(&args, &hello_ll_oper,
+		se = fuse_lowlevel_new(&args, stats_ops(&hello_ll_oper),
 				       sizeof(hello_ll_oper), NULL);
 		if (se != NULL) {
 			if (fuse_set_signal_handlers(se) != -1) {
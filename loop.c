@@ -0,0 +1,87 @@
+// (C) 2012 Dave Vasilevsky <dave@vasilevsky.ca>
+// Licensing: GPL v2, see the COPYING file
+
+#define FUSE_USE_VERSION 26
+
+#include "loop.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void *worker(void *data)
+{
+	struct fuse_session *se = (struct fuse_session *) data;
+	struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+	size_t bufsize = fuse_chan_bufsize(ch);
+	char *mem;
+	int res = 0;
+
+	if (!(mem = malloc(bufsize))) {
+		fuse_session_exit(se);
+		return (void *) (intptr_t) -1;
+	}
+
+	pthread_cleanup_push(free, mem);
+	while (!fuse_session_exited(se)) {
+		struct fuse_chan *tmpch = ch;
+		struct fuse_buf fbuf;
+
+		memset(&fbuf, 0, sizeof(fbuf));
+		fbuf.mem = mem;
+		fbuf.size = bufsize;
+
+		res = fuse_session_receive_buf(se, &fbuf, &tmpch);
+		if (res == -EINTR)
+			continue;
+		if (res <= 0)
+			break;
+
+		// Don't get cancelled halfway through a request
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		fuse_session_process_buf(se, &fbuf, tmpch);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+	pthread_cleanup_pop(1);
+
+	fuse_session_exit(se);
+	return (void *) (intptr_t) (res < 0 ? -1 : 0);
+}
+
+int session_loop_threads(struct fuse_session *se, unsigned threads)
+{
+	pthread_t *tids;
+	sigset_t all, old;
+	unsigned i, started = 0;
+	int err;
+
+	if (threads < 2)
+		return fuse_session_loop(se);
+	if (!(tids = calloc(threads - 1, sizeof(*tids))))
+		return -1;
+
+	// Signals should go to the calling thread, so it can notice the exit
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < threads - 1; ++i) {
+		if (pthread_create(&tids[i], NULL, worker, se) != 0)
+			break;
+		++started;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	err = started ? (int) (intptr_t) worker(se) : -1;
+
+	// Others may be blocked reading the device, wake them up
+	for (i = 0; i < started; ++i)
+		pthread_cancel(tids[i]);
+	for (i = 0; i < started; ++i)
+		pthread_join(tids[i], NULL);
+	free(tids);
+
+	fuse_session_reset(se);
+	return err;
+}
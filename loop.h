@@ -0,0 +1,22 @@
+// (C) 2012 Dave Vasilevsky <dave@vasilevsky.ca>
+// Licensing: GPL v2, see the COPYING file
+
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <fuse_lowlevel.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Like fuse_session_loop(), but with a fixed pool of worker threads. The
+// calling thread is one of them, and the one that gets signals. With fewer
+// than two threads, this is just fuse_session_loop().
+int session_loop_threads(struct fuse_session *se, unsigned threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
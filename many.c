@@ -11,31 +11,9 @@
 #include <limits.h>
 #include <stdio.h>
 
-static const char file_content[] = "Hello World!\n";
-static const size_t file_size      = sizeof(file_content)/sizeof(char) - 1;
+#include "many_shape.h"
 
-static const size_t branch = 64;
-static size_t name_size = 3;
-static const size_t total = 5 * 1000 * 1000;
-
-static int num_parse(char *name) {
-	if (!name)
-		return -1;
-	if (strlen(name) != name_size)
-		return -1;
-	
-	char *end = NULL;
-	int ret = strtol(name, &end, 10);
-	if (*end)
-		return -1;
-	if (ret >= branch)
-		return -1;
-	return ret;
-}
-
-static int64_t child(int64_t dnum, int fnum) {
-	return branch * dnum + 1 + fnum;
-}
+static struct many_shape shape;
 
 static char *split_path(char *path, size_t *n) {
 	int i;
@@ -54,43 +32,34 @@ static int64_t inum_inner(char *path, size_t n) {
 	
 	char *base = split_path(path, &n);
 //	fprintf(stderr, "DIR: %s\nBASE: %s\n", path, base);
-	uint64_t dnum = inum_inner(path, n);
+	int64_t dnum = inum_inner(path, n);
 	if (dnum == -1)
 		return -1;	
-	int fnum = num_parse(base);
+	int64_t fnum = many_parse(&shape, dnum, base);
 	if (fnum == -1)
 		return -1;
 	
-	return child(dnum, fnum);
+	return many_child(&shape, dnum, fnum);
 }
 
 static int64_t inum(const char *path) {
 //	fprintf(stderr, "\nLOOKUP: %s\n", path);
 
-	static char s[PATH_MAX];
+	char s[PATH_MAX];
 	strcpy(s, path);
 	return inum_inner(s, strlen(s));
 }
 
-static int children(int64_t n) {
-	int64_t first = child(n, 0);
-	if (first >= total)
-		return 0;
-	if (first + branch <= total)
-		return branch;
-	return total - first;
-}
-
 static int many_getattr(const char *path, struct stat *stbuf) {
 	int64_t n = inum(path);
 	if (n == -1)
 		return -ENOENT;
 	
-	if (children(n)) {
+	if (many_children(&shape, n)) {
 		stbuf->st_mode = S_IFDIR | 0555;
 	} else {
 		stbuf->st_mode = S_IFREG | 0444;
-		stbuf->st_size = file_size;
+		stbuf->st_size = shape.file_size;
 	}
 	return 0;
 }
@@ -99,7 +68,7 @@ static int many_open(const char *path, struct fuse_file_info *fi) {
 	int64_t n = inum(path);
 	if (n == -1)
 		return -ENOENT;
-	if (children(n))
+	if (many_children(&shape, n))
 		return -EISDIR;
 	if ((fi->flags & O_ACCMODE) != O_RDONLY)
 		return -EACCES; // read-only
@@ -108,29 +77,31 @@ static int many_open(const char *path, struct fuse_file_info *fi) {
 
 static int many_read(const char *path, char *buf, size_t size,
 		off_t offset, struct fuse_file_info *fi) {
-	if (offset >= file_size)
-		return 0;
-	if (offset + size > file_size)
-		size = file_size - offset;
-	memcpy(buf, file_content + offset, size);
-	return size;
+	return many_content(&shape, buf, size, offset);
 }
 
+// Each child's offset is its index plus one, so a listing can resume anywhere
+// without going through the children before it.
 static int many_readdir(const char *path, void *buf,
 		fuse_fill_dir_t filler, off_t offset,
 		struct fuse_file_info *fi) {
 	int64_t n = inum(path);
 	if (n == -1)
 		return -ENOENT;
-	int c = children(n);
+	int64_t c = many_children(&shape, n);
 	if (!c)
 		return -ENOTDIR;
 	
-	int i;
-	static char s[PATH_MAX];
-	for (i = 0; i < c; ++i) {
-		sprintf(s, "%0*d", (int)name_size, i);
-		filler(buf, s, NULL, 0);
+	int64_t i;
+	char s[32];
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	for (i = offset; i < c; ++i) {
+		int64_t k = many_child(&shape, n, i);
+		many_name(&shape, n, i, s, sizeof(s));
+		st.st_mode = many_children(&shape, k) ? S_IFDIR : S_IFREG;
+		if (filler(buf, s, &st, i + 1))
+			break; // Buffer is full
 	}
 	return 0;
 }
@@ -143,5 +114,11 @@ static struct fuse_operations many_fsops = {
 };
 
 int main(int argc, char **argv) {
-	return fuse_main(argc, argv, &many_fsops, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	many_shape_init(&shape, &args);
+	
+	// Nothing ever changes, so let the kernel cache attributes. Otherwise
+	// ls -l has to ask for each entry again every time.
+	fuse_opt_insert_arg(&args, 1, "-oentry_timeout=86400,attr_timeout=86400");
+	return fuse_main(args.argc, args.argv, &many_fsops, NULL);
 }
@@ -0,0 +1,211 @@
+// (C) 2012 Dave Vasilevsky <dave@vasilevsky.ca>
+// Licensing: GPL v2, see the COPYING file
+
+// Like many, but with the low-level API. A node's inode number is just its
+// number plus one, so nothing needs to be remembered about any of them.
+// See many_shape.h for the options.
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+
+#include "many_shape.h"
+#include "throttle.h"
+#include "stats.h"
+
+static struct many_shape shape;
+
+// Nothing here ever changes, so the kernel may cache it all
+static const double timeout = 86400.0;
+
+static fuse_ino_t ino_of(int64_t n) {
+	return n + 1;
+}
+
+// The node for an inode, or -1 if there's none
+static int64_t node_of(fuse_ino_t ino) {
+	if (ino < 1 || !many_exists(&shape, ino - 1))
+		return -1;
+	return ino - 1;
+}
+
+static void many_stat(int64_t n, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_ino = ino_of(n);
+	if (many_children(&shape, n)) {
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+	} else {
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = shape.file_size;
+	}
+}
+
+static void many_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+			    struct fuse_file_info *fi)
+{
+	struct stat stbuf;
+	int64_t n = node_of(ino);
+
+	(void) fi;
+
+	if (n == -1) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	many_stat(n, &stbuf);
+	fuse_reply_attr(req, &stbuf, timeout);
+}
+
+static void many_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	int64_t dnum = node_of(parent);
+	int64_t fnum;
+
+	if (dnum == -1 || !many_children(&shape, dnum)) {
+		fuse_reply_err(req, dnum == -1 ? ENOENT : ENOTDIR);
+		return;
+	}
+	fnum = many_parse(&shape, dnum, name);
+	if (fnum == -1) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	memset(&e, 0, sizeof(e));
+	e.ino = ino_of(many_child(&shape, dnum, fnum));
+	e.attr_timeout = timeout;
+	e.entry_timeout = timeout;
+	many_stat(many_child(&shape, dnum, fnum), &e.attr);
+	fuse_reply_entry(req, &e);
+}
+
+// Offsets are indices: 0 is ".", 1 is "..", and the rest are children
+static void many_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			    off_t off, struct fuse_file_info *fi)
+{
+	int64_t n = node_of(ino);
+	int64_t c;
+	char *buf;
+	size_t used = 0;
+
+	(void) fi;
+
+	if (n == -1 || !(c = many_children(&shape, n))) {
+		fuse_reply_err(req, n == -1 ? ENOENT : ENOTDIR);
+		return;
+	}
+	if (!(buf = malloc(size))) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	for (; off < c + 2; ++off) {
+		struct stat stbuf;
+		char name[32];
+		size_t sz;
+
+		memset(&stbuf, 0, sizeof(stbuf));
+		if (off < 2) {
+			strcpy(name, off ? ".." : ".");
+			stbuf.st_ino = ino_of(off ? many_parent(&shape, n) : n);
+			stbuf.st_mode = S_IFDIR;
+		} else {
+			int64_t k = many_child(&shape, n, off - 2);
+			many_name(&shape, n, off - 2, name, sizeof(name));
+			stbuf.st_ino = ino_of(k);
+			stbuf.st_mode = many_children(&shape, k) ? S_IFDIR : S_IFREG;
+		}
+
+		sz = fuse_add_direntry(req, buf + used, size - used, name,
+				       &stbuf, off + 1);
+		if (sz > size - used)
+			break;
+		used += sz;
+	}
+
+	stats_reply(used);
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+static void many_ll_open(fuse_req_t req, fuse_ino_t ino,
+			 struct fuse_file_info *fi)
+{
+	int64_t n = node_of(ino);
+
+	if (n == -1)
+		fuse_reply_err(req, ENOENT);
+	else if (many_children(&shape, n))
+		fuse_reply_err(req, EISDIR);
+	else if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		fuse_reply_err(req, EACCES);
+	else
+		fuse_reply_open(req, fi);
+}
+
+static void many_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			 off_t off, struct fuse_file_info *fi)
+{
+	char *buf;
+
+	(void) fi;
+
+	if (!(buf = malloc(size))) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	size = many_content(&shape, buf, size, off);
+	stats_reply(size);
+	fuse_reply_buf(req, buf, size);
+	free(buf);
+}
+
+static struct fuse_lowlevel_ops many_ll_oper = {
+	.lookup		= many_ll_lookup,
+	.getattr	= many_ll_getattr,
+	.readdir	= many_ll_readdir,
+	.open		= many_ll_open,
+	.read		= many_ll_read,
+};
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_chan *ch;
+	char *mountpoint;
+	int err = -1;
+
+	many_shape_init(&shape, &args);
+	throttle_init(&args);
+	stats_init(&args, NULL);
+	if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) != -1 &&
+	    (ch = fuse_mount(mountpoint, &args)) != NULL) {
+		struct fuse_session *se;
+
+		se = fuse_lowlevel_new(&args, throttle_ops(stats_ops(&many_ll_oper), 1),
+				       sizeof(many_ll_oper), NULL);
+		if (se != NULL) {
+			if (fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+				err = fuse_session_loop(se);
+				throttle_stop();
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	fuse_opt_free_args(&args);
+
+	return err ? 1 : 0;
+}
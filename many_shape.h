@@ -0,0 +1,204 @@
+// (C) 2012 Dave Vasilevsky <dave@vasilevsky.ca>
+// Licensing: GPL v2, see the COPYING file
+
+// The shape of the tree served by many and many_ll, set by mount options:
+//
+//   -o fanout=N[:N...]  Children of each directory, per level. The last
+//                       one given holds for all deeper levels. (64)
+//   -o depth=N          Levels below the root. The deepest holds only files,
+//                       so depth=1 is a root full of files. (unlimited)
+//   -o total=N          Nodes in the tree, files and directories, at least
+//                       two. (5M)
+//   -o size=N           Size of each file, like 4K or 1G.
+//   -o pattern=STR      Contents of each file, repeated to fill it.
+//   -o namelen=N        Minimum length of names, zero-padded. (3)
+//
+// Nodes are numbered breadth-first from the root, which is node zero. Any
+// node whose number is below the total exists. A node is a directory if
+// it's above the deepest level, and its first child exists.
+
+#ifndef MANY_SHAPE_H
+#define MANY_SHAPE_H
+
+#include <fuse_opt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stddef.h>
+
+#include "parse_size.h"
+
+#define MANY_MAX_LEVELS 64
+
+struct many_shape {
+	char *fanout_str, *size_str, *pattern;
+	unsigned depth, namelen;
+	unsigned long long total;
+
+	// Worked out from the above
+	unsigned levels;			// Levels that have any nodes
+	int64_t fanout[MANY_MAX_LEVELS];	// Children of a node, per level
+	int64_t start[MANY_MAX_LEVELS + 1];	// First node of each level
+	int width[MANY_MAX_LEVELS];		// Name length, per level
+	size_t pattern_len;
+	int64_t file_size;
+};
+
+static const struct fuse_opt many_shape_opts[] = {
+	{ "fanout=%s", offsetof(struct many_shape, fanout_str), 0 },
+	{ "depth=%u", offsetof(struct many_shape, depth), 0 },
+	{ "total=%llu", offsetof(struct many_shape, total), 0 },
+	{ "size=%s", offsetof(struct many_shape, size_str), 0 },
+	{ "pattern=%s", offsetof(struct many_shape, pattern), 0 },
+	{ "namelen=%u", offsetof(struct many_shape, namelen), 0 },
+	FUSE_OPT_END
+};
+
+static void many_shape_die(const char *what, const char *val) {
+	fprintf(stderr, "Bad %s: %s\n", what, val);
+	exit(-2);
+}
+
+// Parse the options, and work out where each level starts
+static void many_shape_init(struct many_shape *s, struct fuse_args *args) {
+	unsigned nfan = 0, i;
+	int64_t fan[MANY_MAX_LEVELS];
+	char *p;
+
+	memset(s, 0, sizeof(*s));
+	s->total = 5 * 1000 * 1000;
+	s->namelen = 3;
+	if (fuse_opt_parse(args, s, many_shape_opts, NULL) == -1)
+		exit(-2);
+
+	if (!s->pattern)
+		s->pattern = "Hello World!\n";
+	s->pattern_len = strlen(s->pattern);
+	if (!s->pattern_len)
+		many_shape_die("pattern", "(empty)");
+	s->file_size = s->size_str ? parse_size(s->size_str, NULL)
+		: (int64_t)s->pattern_len;
+
+	p = s->fanout_str ? s->fanout_str : "64";
+	do {
+		char *end;
+		long long f = strtoll(p, &end, 10);
+		if (end == p || f < 1 || (*end && *end != ':')
+				|| nfan == MANY_MAX_LEVELS)
+			many_shape_die("fanout", s->fanout_str);
+		fan[nfan++] = f;
+		p = *end ? end + 1 : end;
+	} while (*p);
+
+	// The root must have a child, to be a directory
+	if (s->total < 2 || s->total > INT64_MAX)
+		many_shape_die("total", "out of range");
+	s->start[0] = 0;
+	for (i = 0; ; ++i) {
+		uint64_t count = 1, room = s->total - s->start[i];
+		int64_t f = fan[i < nfan ? i : nfan - 1];
+		char digits[32];
+
+		// Levels grow geometrically, so the count soon overflows. Anything
+		// past the total is cut off anyhow.
+		if (i) {
+			uint64_t prev = s->start[i] - s->start[i - 1];
+			uint64_t pfan = s->fanout[i - 1];
+			count = prev > UINT64_MAX / pfan ? UINT64_MAX : prev * pfan;
+		}
+		s->levels = i + 1;
+		s->start[i + 1] = count > room
+			? (int64_t)s->total : s->start[i] + (int64_t)count;
+		s->fanout[i] = f;
+		s->width[i] = snprintf(digits, sizeof(digits), "%lld",
+			(long long)(f - 1));
+		if (s->width[i] < (int)s->namelen)
+			s->width[i] = s->namelen;
+
+		if (s->start[i + 1] >= (int64_t)s->total)
+			break;
+		if (s->depth && i == s->depth)
+			break;
+		if (i + 1 == MANY_MAX_LEVELS)
+			many_shape_die("shape", "too many levels");
+	}
+}
+
+static inline unsigned many_level(const struct many_shape *s, int64_t n) {
+	unsigned l = 0;
+	while (n >= s->start[l + 1])
+		++l;
+	return l;
+}
+
+static inline int many_exists(const struct many_shape *s, int64_t n) {
+	return n >= 0 && n < s->start[s->levels];
+}
+
+static inline int64_t many_child(const struct many_shape *s, int64_t n,
+		int64_t i) {
+	unsigned l = many_level(s, n);
+	return s->start[l + 1] + (n - s->start[l]) * s->fanout[l] + i;
+}
+
+static inline int64_t many_parent(const struct many_shape *s, int64_t n) {
+	unsigned l = many_level(s, n);
+	if (l == 0)
+		return 0;
+	return s->start[l - 1] + (n - s->start[l]) / s->fanout[l - 1];
+}
+
+// How many children a node has. Nodes without any are files.
+static inline int64_t many_children(const struct many_shape *s, int64_t n) {
+	unsigned l = many_level(s, n);
+	int64_t first, end = s->start[s->levels];
+	if (l + 1 >= s->levels)
+		return 0;
+	first = many_child(s, n, 0);
+	if (first >= end)
+		return 0;
+	return end - first < s->fanout[l] ? end - first : s->fanout[l];
+}
+
+// The name of the i'th child of a node
+static inline void many_name(const struct many_shape *s, int64_t n, int64_t i,
+		char *buf, size_t size) {
+	snprintf(buf, size, "%0*lld", s->width[many_level(s, n)], (long long)i);
+}
+
+// Which child of a node a name refers to, or -1 if none
+static inline int64_t many_parse(const struct many_shape *s, int64_t n,
+		const char *name) {
+	char *end;
+	long long i;
+	if (!isdigit((unsigned char)*name)
+			|| strlen(name) != (size_t)s->width[many_level(s, n)])
+		return -1;
+	i = strtoll(name, &end, 10);
+	if (*end || i >= many_children(s, n))
+		return -1;
+	return i;
+}
+
+// Fill a buffer with file contents, starting at an offset
+static inline size_t many_content(const struct many_shape *s, char *buf,
+		size_t size, int64_t off) {
+	size_t done = 0;
+	if (off >= s->file_size)
+		return 0;
+	if (size > (uint64_t)(s->file_size - off))
+		size = s->file_size - off;
+	while (done < size) {
+		size_t pos = (off + done) % s->pattern_len;
+		size_t take = s->pattern_len - pos;
+		if (take > size - done)
+			take = size - done;
+		memcpy(buf + done, s->pattern + pos, take);
+		done += take;
+	}
+	return done;
+}
+
+#endif
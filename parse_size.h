@@ -0,0 +1,52 @@
+// (C) 2012 Dave Vasilevsky <dave@vasilevsky.ca>
+// Licensing: GPL v2, see the COPYING file
+
+// Sizes given as options, like 64M or 16GB
+
+#ifndef PARSE_SIZE_H
+#define PARSE_SIZE_H
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+// A size in bytes, with an optional suffix of K, M, G, T or P, and maybe B
+// after it. If sizespec is NULL, dflt is used. Exits if it's bad.
+static off_t parse_size(const char *sizespec, const char *dflt) {
+	long long ret;
+	char *endptr;
+	size_t slen;
+
+	if (!sizespec)
+		sizespec = dflt;
+
+	errno = 0;
+	ret = strtoll(sizespec, &endptr, 10);
+
+	if (endptr != sizespec && errno == 0 && ret >= 0) {
+		slen = strlen(endptr);
+		if (slen == 0)
+			return ret;
+		if (slen == 1 || (slen == 2 && tolower(endptr[1]) == 'b')) {
+			const char *sufs = "kmgtp";
+			char c = tolower(endptr[0]);
+			const char *suf = strchr(sufs, c);
+			if (suf) {
+				long i;
+				for (i = 0; i <= suf - sufs && ret <= LLONG_MAX / 1024; ++i)
+					ret *= 1024;
+				if (i > suf - sufs)
+					return ret;
+			}
+		}
+	}
+
+	fprintf(stderr, "Size parse error: %s\n", sizespec);
+	exit(-2);
+}
+
+#endif
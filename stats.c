@@ -0,0 +1,483 @@
+// (C) 2012 Dave Vasilevsky <dave@vasilevsky.ca>
+// Licensing: GPL v2, see the COPYING file
+
+#define FUSE_USE_VERSION 26
+
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STATS_NAME ".fuse_stats"
+#define STATS_INO ((fuse_ino_t) -2)	// Unlikely to be used by anything else
+
+enum { OP_LOOKUP, OP_FORGET, OP_GETATTR, OP_READLINK, OP_OPEN, OP_READ,
+	OP_FLUSH, OP_RELEASE, OP_OPENDIR, OP_READDIR, OP_RELEASEDIR, OP_STATFS,
+	OP_GETXATTR, OP_LISTXATTR, OP_ACCESS, OP_FORGET_MULTI, NOPS };
+
+static const char *op_names[NOPS] = { "lookup", "forget", "getattr",
+	"readlink", "open", "read", "flush", "release", "opendir", "readdir",
+	"releasedir", "statfs", "getxattr", "listxattr", "access",
+	"forget_multi" };
+
+// Histogram buckets are log-linear, like HDR histograms: values below 16
+// get a bucket each, and each power of two above that is split into 8.
+// Anything from 2^40 up lands in the last bucket.
+#define SUB_BUCKETS 8
+#define MAX_BITS 40
+#define NBUCKETS (16 + (MAX_BITS - 4) * SUB_BUCKETS)
+
+struct op_stats {
+	uint64_t count, ns, bytes;
+	uint64_t time_hist[NBUCKETS];	// Handling time, in nanoseconds
+	uint64_t size_hist[NBUCKETS];	// Data reply sizes, in bytes
+};
+
+// Each thread's counts. Only that thread writes them, so it needs no locks
+// or atomic read-modify-writes; a report just adds them all up.
+struct block {
+	struct op_stats op[NOPS];
+	struct block *next;
+};
+
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct block *blocks;
+static __thread struct block *mine;
+static __thread int current_op = -1;
+static __thread int deferred;
+
+static const struct fuse_lowlevel_ops *inner;
+static struct fuse_lowlevel_ops outer;
+static void (*extra_report)(FILE *out);
+static int stats_file;	// Whether there's a .fuse_stats, with -o stats
+static int report_pipe[2] = { -1, -1 };
+
+// A snapshot of the report, for one open of the stats file
+struct report {
+	char *text;
+	size_t size;
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned bucket_of(uint64_t v) {
+	unsigned msb;
+	if (v < 16)
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	if (msb >= MAX_BITS)
+		return NBUCKETS - 1;
+	return 16 + (msb - 4) * SUB_BUCKETS + ((v >> (msb - 3)) & 7);
+}
+
+// The largest value that lands in a bucket
+static uint64_t bucket_top(unsigned b) {
+	unsigned msb, sub;
+	if (b < 16)
+		return b;
+	msb = (b - 16) / SUB_BUCKETS + 4;
+	sub = (b - 16) % SUB_BUCKETS;
+	return ((uint64_t) (SUB_BUCKETS + sub + 1) << (msb - 3)) - 1;
+}
+
+static void bump(uint64_t *p, uint64_t v) {
+	__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v,
+		__ATOMIC_RELAXED);
+}
+
+static struct block *my_block(void) {
+	if (!mine) {
+		if (!(mine = calloc(1, sizeof(*mine))))
+			return NULL;
+		pthread_mutex_lock(&blocks_lock);
+		mine->next = blocks;
+		blocks = mine;
+		pthread_mutex_unlock(&blocks_lock);
+	}
+	return mine;
+}
+
+static uint64_t begin(int op) {
+	current_op = op;
+	return now_ns();
+}
+
+static void end(int op, uint64_t start) {
+	uint64_t ns = now_ns() - start;
+	struct block *b = my_block();
+	current_op = -1;
+	if (deferred) {
+		deferred = 0;
+		return;
+	}
+	if (b) {
+		bump(&b->op[op].count, 1);
+		bump(&b->op[op].ns, ns);
+		bump(&b->op[op].time_hist[bucket_of(ns)], 1);
+	}
+}
+
+void stats_defer(void) {
+	if (current_op != -1)
+		deferred = 1;
+}
+
+void stats_reply(size_t size) {
+	struct block *b;
+	if (current_op == -1 || !(b = my_block()))
+		return;
+	bump(&b->op[current_op].bytes, size);
+	bump(&b->op[current_op].size_hist[bucket_of(size)], 1);
+}
+
+// A percentile of a histogram
+static uint64_t percentile(const uint64_t *hist, uint64_t count, double p) {
+	uint64_t want = count * p, seen = 0;
+	unsigned b;
+	for (b = 0; b < NBUCKETS; ++b) {
+		seen += hist[b];
+		if (seen > want)
+			return bucket_top(b);
+	}
+	return bucket_top(NBUCKETS - 1);
+}
+
+static void write_report(FILE *out) {
+	static const double ps[] = { 0.5, 0.9, 0.99, 0.999 };
+	struct op_stats *sum = calloc(NOPS, sizeof(*sum));
+	struct block *b;
+	unsigned i, j, k;
+
+	if (!sum)
+		return;
+	pthread_mutex_lock(&blocks_lock);
+	for (b = blocks; b; b = b->next) {
+		for (i = 0; i < NOPS; ++i) {
+			const struct op_stats *s = &b->op[i];
+			sum[i].count += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+			sum[i].ns += __atomic_load_n(&s->ns, __ATOMIC_RELAXED);
+			sum[i].bytes += __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+			for (k = 0; k < NBUCKETS; ++k) {
+				sum[i].time_hist[k] += __atomic_load_n(&s->time_hist[k],
+					__ATOMIC_RELAXED);
+				sum[i].size_hist[k] += __atomic_load_n(&s->size_hist[k],
+					__ATOMIC_RELAXED);
+			}
+		}
+	}
+	pthread_mutex_unlock(&blocks_lock);
+
+	fprintf(out, "%-13s %10s %10s %8s %8s %8s %8s %14s %8s\n", "op", "count",
+		"mean_us", "p50_us", "p90_us", "p99_us", "p999_us", "bytes",
+		"p50_size");
+	for (i = 0; i < NOPS; ++i) {
+		struct op_stats *s = &sum[i];
+		uint64_t replies = 0;
+		if (!s->count)
+			continue;
+		fprintf(out, "%-13s %10llu %10.1f", op_names[i],
+			(unsigned long long) s->count, s->ns / 1000.0 / s->count);
+		for (j = 0; j < sizeof(ps) / sizeof(ps[0]); ++j)
+			fprintf(out, " %8.1f",
+				percentile(s->time_hist, s->count, ps[j]) / 1000.0);
+		for (k = 0; k < NBUCKETS; ++k)
+			replies += s->size_hist[k];
+		fprintf(out, " %14llu", (unsigned long long) s->bytes);
+		if (replies)
+			fprintf(out, " %8llu", (unsigned long long)
+				percentile(s->size_hist, replies, 0.5));
+		fprintf(out, "\n");
+	}
+	if (extra_report)
+		extra_report(out);
+	free(sum);
+}
+
+// On SIGUSR1, wake up the reporting thread. Printing the report isn't safe
+// in a signal handler.
+static void report_signal(int sig) {
+	char c = 0;
+	int e = errno;
+	ssize_t r = write(report_pipe[1], &c, 1);
+	(void) sig;
+	(void) r; // Nothing to be done if it fails
+	errno = e;
+}
+
+static void *report_thread(void *arg) {
+	char c;
+	(void) arg;
+	while (read(report_pipe[0], &c, 1) != 0) {
+		write_report(stderr);
+		fflush(stderr);
+	}
+	return NULL;
+}
+
+static const struct fuse_opt option_list[] = {
+	{ "stats", 0, 1 },
+	FUSE_OPT_END
+};
+
+void stats_init(struct fuse_args *args, void (*extra)(FILE *out)) {
+	pthread_t tid;
+	sigset_t all, old;
+	struct sigaction sa;
+
+	if (fuse_opt_parse(args, &stats_file, option_list, NULL) == -1)
+		exit(-2);
+	extra_report = extra;
+	if (pipe(report_pipe) != 0) {
+		perror("pipe");
+		exit(-1);
+	}
+	fcntl(report_pipe[1], F_SETFL, O_NONBLOCK);
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&tid, NULL, report_thread, NULL) != 0) {
+		fprintf(stderr, "Can't start report thread\n");
+		exit(-1);
+	}
+	pthread_detach(tid);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = report_signal;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+static void stats_attr(struct stat *st) {
+	memset(st, 0, sizeof(*st));
+	st->st_ino = STATS_INO;
+	st->st_mode = S_IFREG | 0444;
+	st->st_nlink = 1;
+}
+
+// The stats file is open with direct I/O, so its size of zero doesn't stop
+// anyone reading it
+static void stats_open(fuse_req_t req, struct fuse_file_info *fi) {
+	struct report *r = calloc(1, sizeof(*r));
+	FILE *out;
+
+	if (!r || !(out = open_memstream(&r->text, &r->size))) {
+		free(r);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	write_report(out);
+	fclose(out);
+
+	fi->fh = (uintptr_t) r;
+	fi->direct_io = 1;
+	if (fuse_reply_open(req, fi) != 0) {
+		free(r->text);
+		free(r);
+	}
+}
+
+static void stats_read(fuse_req_t req, size_t size, off_t off,
+		struct fuse_file_info *fi) {
+	struct report *r = (struct report *) (uintptr_t) fi->fh;
+	if (off >= r->size)
+		fuse_reply_buf(req, NULL, 0);
+	else
+		fuse_reply_buf(req, r->text + off,
+			size < r->size - off ? size : r->size - off);
+}
+
+// Time a call to the wrapped operation
+#define CALL(op, name, ...) do { \
+		uint64_t start = begin(op); \
+		inner->name(__VA_ARGS__); \
+		end(op, start); \
+	} while (0)
+
+static void s_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	if (stats_file && parent == FUSE_ROOT_ID
+			&& strcmp(name, STATS_NAME) == 0) {
+		struct fuse_entry_param e;
+		memset(&e, 0, sizeof(e));
+		e.ino = STATS_INO;
+		stats_attr(&e.attr);
+		fuse_reply_entry(req, &e);
+	} else if (inner->lookup) {
+		CALL(OP_LOOKUP, lookup, req, parent, name);
+	} else {
+		fuse_reply_err(req, ENOSYS);
+	}
+}
+
+static void s_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	if (ino != STATS_INO && inner->forget)
+		CALL(OP_FORGET, forget, req, ino, nlookup);
+	else
+		fuse_reply_none(req);
+}
+
+static void s_getattr(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	if (ino == STATS_INO) {
+		struct stat st;
+		stats_attr(&st);
+		fuse_reply_attr(req, &st, 0);
+	} else if (inner->getattr) {
+		CALL(OP_GETATTR, getattr, req, ino, fi);
+	} else {
+		fuse_reply_err(req, ENOSYS);
+	}
+}
+
+static void s_readlink(fuse_req_t req, fuse_ino_t ino) {
+	if (ino == STATS_INO)
+		fuse_reply_err(req, EINVAL);
+	else
+		CALL(OP_READLINK, readlink, req, ino);
+}
+
+static void s_open(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	if (ino == STATS_INO)
+		stats_open(req, fi);
+	else if (inner->open)
+		CALL(OP_OPEN, open, req, ino, fi);
+	else
+		fuse_reply_open(req, fi);
+}
+
+static void s_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi) {
+	if (ino == STATS_INO)
+		stats_read(req, size, off, fi);
+	else if (inner->read)
+		CALL(OP_READ, read, req, ino, size, off, fi);
+	else
+		fuse_reply_err(req, ENOSYS);
+}
+
+static void s_flush(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	if (ino == STATS_INO)
+		fuse_reply_err(req, 0);
+	else
+		CALL(OP_FLUSH, flush, req, ino, fi);
+}
+
+static void s_release(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	if (ino == STATS_INO) {
+		struct report *r = (struct report *) (uintptr_t) fi->fh;
+		free(r->text);
+		free(r);
+		fuse_reply_err(req, 0);
+	} else if (inner->release) {
+		CALL(OP_RELEASE, release, req, ino, fi);
+	} else {
+		fuse_reply_err(req, 0);
+	}
+}
+
+#define S_DIR(name, op, ...) \
+	if (ino == STATS_INO) \
+		fuse_reply_err(req, ENOTDIR); \
+	else \
+		CALL(op, name, req, ino, __VA_ARGS__);
+
+static void s_opendir(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	S_DIR(opendir, OP_OPENDIR, fi)
+}
+
+static void s_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi) {
+	S_DIR(readdir, OP_READDIR, size, off, fi)
+}
+
+static void s_releasedir(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	S_DIR(releasedir, OP_RELEASEDIR, fi)
+}
+
+static void s_statfs(fuse_req_t req, fuse_ino_t ino) {
+	CALL(OP_STATFS, statfs, req, ino == STATS_INO ? FUSE_ROOT_ID : ino);
+}
+
+static void s_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+		size_t size) {
+	if (ino == STATS_INO)
+		fuse_reply_err(req, ENODATA);
+	else
+		CALL(OP_GETXATTR, getxattr, req, ino, name, size);
+}
+
+static void s_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+	if (ino == STATS_INO && size)
+		fuse_reply_buf(req, NULL, 0);
+	else if (ino == STATS_INO)
+		fuse_reply_xattr(req, 0);
+	else
+		CALL(OP_LISTXATTR, listxattr, req, ino, size);
+}
+
+static void s_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+	if (ino == STATS_INO)
+		fuse_reply_err(req, 0);
+	else
+		CALL(OP_ACCESS, access, req, ino, mask);
+}
+
+#if FUSE_VERSION >= 29
+static void s_forget_multi(fuse_req_t req, size_t count,
+		struct fuse_forget_data *forgets) {
+	size_t i, kept = 0;
+
+	// The wrapped filesystem has never heard of the stats file
+	for (i = 0; i < count; ++i)
+		if (forgets[i].ino != STATS_INO)
+			forgets[kept++] = forgets[i];
+	CALL(OP_FORGET_MULTI, forget_multi, req, kept, forgets);
+}
+#endif
+
+const struct fuse_lowlevel_ops *stats_ops(
+		const struct fuse_lowlevel_ops *ops) {
+	inner = ops;
+	outer = *ops;
+
+	// These are needed for the stats file, whether or not ops has them
+	outer.lookup = s_lookup;
+	outer.forget = s_forget;
+	outer.getattr = s_getattr;
+	outer.open = s_open;
+	outer.read = s_read;
+	outer.release = s_release;
+
+	// Others are counted, if they're there at all
+#define WRAP(name) if (ops->name) outer.name = s_##name
+	WRAP(readlink);
+	WRAP(flush);
+	WRAP(opendir);
+	WRAP(readdir);
+	WRAP(releasedir);
+	WRAP(statfs);
+	WRAP(getxattr);
+	WRAP(listxattr);
+	WRAP(access);
+#if FUSE_VERSION >= 29
+	WRAP(forget_multi);
+#endif
+#undef WRAP
+	return &outer;
+}
@@ -0,0 +1,47 @@
+// (C) 2012 Dave Vasilevsky <dave@vasilevsky.ca>
+// Licensing: GPL v2, see the COPYING file
+
+// Counts the requests a low-level filesystem serves, and how long each kind
+// takes to handle. For each operation it keeps a count, a histogram of
+// handling times, and the sizes of data replies.
+//
+// A report can be had by sending the daemon SIGUSR1, which prints it to
+// stderr. With the mount option -o stats, it can also be read from the file
+// .fuse_stats in the root of the mount, which is hidden from directory
+// listings. That file hides anything of the same name in the filesystem, so
+// it's left out unless asked for.
+//
+// Time is measured from when the filesystem is handed a request until it
+// returns. A reply that's deferred, like by throttle.h, isn't counted, so
+// wrap the ops with stats before throttling them. A filesystem that puts a
+// request aside itself can call stats_defer(), and hand it to the wrapped
+// ops again later; then only that later call is counted.
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Set up reporting, taking the stats option from args. The extra function,
+// if any, adds lines to each report.
+void stats_init(struct fuse_args *args, void (*extra)(FILE *out));
+
+// The operations to give FUSE, which count calls then pass them on to ops
+const struct fuse_lowlevel_ops *stats_ops(const struct fuse_lowlevel_ops *ops);
+
+// Note the size of a data reply, from within read or readdir
+void stats_reply(size_t size);
+
+// From within an operation, don't count this call of it
+void stats_defer(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
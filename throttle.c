@@ -0,0 +1,450 @@
+// (C) 2012 Dave Vasilevsky <dave@vasilevsky.ca>
+// Licensing: GPL v2, see the COPYING file
+
+#define FUSE_USE_VERSION 26
+
+#include "throttle.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "parse_size.h"
+
+// Credit a rate limit can build up while idle, in seconds
+#define BURST 0.01
+
+enum { DIST_NONE, DIST_FIXED, DIST_UNIFORM, DIST_LOGNORMAL };
+
+struct dist {
+	int kind;
+	double a, b;	// In seconds, except lognormal's sigma
+};
+
+// A token bucket, kept as the time its debt is paid off
+struct bucket {
+	double rate;	// Per second, or zero for no limit
+	double paid;
+};
+
+enum { OP_LOOKUP, OP_GETATTR, OP_READLINK, OP_OPEN, OP_READ, OP_RELEASE,
+	OP_OPENDIR, OP_READDIR, OP_RELEASEDIR, OP_STATFS, OP_ACCESS };
+
+// An operation waiting to be handled
+struct call {
+	double due;
+	int op;
+	fuse_req_t req;
+	fuse_ino_t ino;
+	char *name;
+	size_t size;
+	off_t off;
+	int mask;
+	struct fuse_file_info fi, *fip;
+};
+
+struct options {
+	char *latency, *read_latency, *spike, *bandwidth;
+	double iops;
+	unsigned threads;	// Zero to match the session
+};
+
+static struct options opts = { NULL, NULL, NULL, NULL, 0, 0 };
+
+static const struct fuse_opt option_list[] = {
+	{ "latency=%s", offsetof(struct options, latency), 0 },
+	{ "read_latency=%s", offsetof(struct options, read_latency), 0 },
+	{ "spike=%s", offsetof(struct options, spike), 0 },
+	{ "bandwidth=%s", offsetof(struct options, bandwidth), 0 },
+	{ "iops=%lf", offsetof(struct options, iops), 0 },
+	{ "delay_threads=%u", offsetof(struct options, threads), 0 },
+	FUSE_OPT_END
+};
+
+static struct dist latency, read_latency;
+static double spike_prob, spike_delay;
+static struct bucket bytes, ops;
+static int enabled;
+
+static const struct fuse_lowlevel_ops *inner;
+static struct fuse_lowlevel_ops outer;
+
+// The queue of waiting calls, a heap ordered by due time
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+static struct call **heap;
+static size_t heap_len, heap_cap;
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;	// Guarded by lock too
+static int stopping;
+static pthread_t *tids;
+static unsigned started;
+
+static void bad(const char *what, const char *val) {
+	fprintf(stderr, "Bad %s: %s\n", what, val);
+	exit(-2);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Uniform in (0, 1]
+static double rand_unit(void) {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return ((rng * 0x2545f4914f6cdd1dULL >> 11) + 1) / 9007199254740992.0;
+}
+
+static void parse_dist(struct dist *d, const char *spec) {
+	double a = 0, b = 0;
+	char c;
+
+	if (sscanf(spec, "fixed:%lf%c", &a, &c) == 1 && a >= 0)
+		d->kind = DIST_FIXED;
+	else if (sscanf(spec, "uniform:%lf:%lf%c", &a, &b, &c) == 2
+			&& a >= 0 && b >= a)
+		d->kind = DIST_UNIFORM;
+	else if (sscanf(spec, "lognormal:%lf:%lf%c", &a, &b, &c) == 2
+			&& a > 0 && b >= 0)
+		d->kind = DIST_LOGNORMAL;
+	else
+		bad("latency", spec);
+	d->a = a / 1000;
+	d->b = d->kind == DIST_LOGNORMAL ? b : b / 1000;
+}
+
+// A delay from a distribution. Call with the lock held.
+static double sample(const struct dist *d) {
+	double u1, u2;
+
+	switch (d->kind) {
+	case DIST_FIXED:
+		return d->a;
+	case DIST_UNIFORM:
+		return d->a + (d->b - d->a) * rand_unit();
+	case DIST_LOGNORMAL:
+		u1 = rand_unit();
+		u2 = rand_unit();
+		return d->a * exp(d->b * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2));
+	}
+	return 0;
+}
+
+// When something costing this much may go ahead. Call with the lock held.
+static double charge(struct bucket *b, double cost, double t) {
+	if (!b->rate)
+		return t;
+	if (b->paid < t - BURST)
+		b->paid = t - BURST;
+	b->paid += cost / b->rate;
+	return b->paid > t ? b->paid : t;
+}
+
+void throttle_init(struct fuse_args *args) {
+	if (fuse_opt_parse(args, &opts, option_list, NULL) == -1)
+		exit(-2);
+
+	if (opts.latency) {
+		parse_dist(&latency, opts.latency);
+		read_latency = latency;
+	}
+	if (opts.read_latency)
+		parse_dist(&read_latency, opts.read_latency);
+	if (opts.spike) {
+		char c;
+		if (sscanf(opts.spike, "%lf:%lf%c", &spike_prob, &spike_delay,
+				&c) != 2 || spike_prob < 0 || spike_prob > 1 || spike_delay < 0)
+			bad("spike", opts.spike);
+		spike_delay /= 1000;
+	}
+	if (opts.bandwidth && !(bytes.rate = parse_size(opts.bandwidth, NULL)))
+		bad("bandwidth", opts.bandwidth);
+	if (opts.iops < 0)
+		bad("iops", "negative");
+	ops.rate = opts.iops;
+
+	enabled = latency.kind || read_latency.kind || opts.spike || bytes.rate
+		|| ops.rate;
+}
+
+// Handle a call, now that it's due
+static void run(struct call *c) {
+	switch (c->op) {
+	case OP_LOOKUP: inner->lookup(c->req, c->ino, c->name); break;
+	case OP_GETATTR: inner->getattr(c->req, c->ino, c->fip); break;
+	case OP_READLINK: inner->readlink(c->req, c->ino); break;
+	case OP_OPEN: inner->open(c->req, c->ino, c->fip); break;
+	case OP_READ:
+		inner->read(c->req, c->ino, c->size, c->off, c->fip);
+		break;
+	case OP_RELEASE: inner->release(c->req, c->ino, c->fip); break;
+	case OP_OPENDIR: inner->opendir(c->req, c->ino, c->fip); break;
+	case OP_READDIR:
+		inner->readdir(c->req, c->ino, c->size, c->off, c->fip);
+		break;
+	case OP_RELEASEDIR: inner->releasedir(c->req, c->ino, c->fip); break;
+	case OP_STATFS: inner->statfs(c->req, c->ino); break;
+	case OP_ACCESS: inner->access(c->req, c->ino, c->mask); break;
+	}
+	free(c->name);
+	free(c);
+}
+
+static void heap_push(struct call *c) {
+	size_t i = heap_len++;
+	while (i) {
+		size_t p = (i - 1) / 2;
+		if (heap[p]->due <= c->due)
+			break;
+		heap[i] = heap[p];
+		i = p;
+	}
+	heap[i] = c;
+}
+
+static struct call *heap_pop(void) {
+	struct call *top = heap[0], *last = heap[--heap_len];
+	size_t i = 0, k;
+	while ((k = 2 * i + 1) < heap_len) {
+		if (k + 1 < heap_len && heap[k + 1]->due < heap[k]->due)
+			++k;
+		if (last->due <= heap[k]->due)
+			break;
+		heap[i] = heap[k];
+		i = k;
+	}
+	heap[i] = last;
+	return top;
+}
+
+// Work out when a call is due, and queue it. If it's due already, just
+// handle it.
+static void schedule(struct call *c) {
+	double t = now(), start;
+	int is_read = c->op == OP_READ;
+
+	pthread_mutex_lock(&lock);
+	start = charge(&ops, 1, t);
+	if (is_read) {
+		double s = charge(&bytes, c->size, t);
+		if (s > start)
+			start = s;
+	}
+	c->due = start + sample(is_read ? &read_latency : &latency);
+	if (spike_prob && rand_unit() <= spike_prob)
+		c->due += spike_delay;
+
+	if (c->due <= t || stopping) {
+		pthread_mutex_unlock(&lock);
+		run(c);
+		return;
+	}
+	if (heap_len == heap_cap) {
+		size_t cap = heap_cap ? 2 * heap_cap : 64;
+		struct call **h = realloc(heap, cap * sizeof(*h));
+		if (!h) {
+			pthread_mutex_unlock(&lock);
+			fuse_reply_err(c->req, ENOMEM);
+			free(c->name);
+			free(c);
+			return;
+		}
+		heap = h;
+		heap_cap = cap;
+	}
+	heap_push(c);
+	if (heap[0] == c)
+		pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+static void *delay_worker(void *arg) {
+	(void) arg;
+	pthread_mutex_lock(&lock);
+	while (!stopping) {
+		struct call *c;
+		double due;
+
+		if (!heap_len) {
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		due = heap[0]->due;
+		if (due > now()) {
+			struct timespec ts;
+			ts.tv_sec = due;
+			ts.tv_nsec = (due - ts.tv_sec) * 1e9;
+			pthread_cond_timedwait(&cond, &lock, &ts);
+			continue;
+		}
+
+		c = heap_pop();
+		pthread_mutex_unlock(&lock);
+		run(c);
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static struct call *new_call(int op, fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	struct call *c = calloc(1, sizeof(*c));
+	if (!c) {
+		fuse_reply_err(req, ENOMEM);
+		return NULL;
+	}
+	c->op = op;
+	c->req = req;
+	c->ino = ino;
+	if (fi) {	// It won't outlive the call, so keep a copy
+		c->fi = *fi;
+		c->fip = &c->fi;
+	}
+	return c;
+}
+
+static void t_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	struct call *c = new_call(OP_LOOKUP, req, parent, NULL);
+	if (!c)
+		return;
+	if (!(c->name = strdup(name))) {
+		fuse_reply_err(req, ENOMEM);
+		free(c);
+		return;
+	}
+	schedule(c);
+}
+
+static void t_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi) {
+	struct call *c = new_call(OP_READ, req, ino, fi);
+	if (c) {
+		c->size = size;
+		c->off = off;
+		schedule(c);
+	}
+}
+
+static void t_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi) {
+	struct call *c = new_call(OP_READDIR, req, ino, fi);
+	if (c) {
+		c->size = size;
+		c->off = off;
+		schedule(c);
+	}
+}
+
+static void t_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+	struct call *c = new_call(OP_ACCESS, req, ino, NULL);
+	if (c) {
+		c->mask = mask;
+		schedule(c);
+	}
+}
+
+#define T_FI(name, op) \
+	static void t_##name(fuse_req_t req, fuse_ino_t ino, \
+			struct fuse_file_info *fi) { \
+		struct call *c = new_call(op, req, ino, fi); \
+		if (c) \
+			schedule(c); \
+	}
+T_FI(getattr, OP_GETATTR)
+T_FI(open, OP_OPEN)
+T_FI(release, OP_RELEASE)
+T_FI(opendir, OP_OPENDIR)
+T_FI(releasedir, OP_RELEASEDIR)
+
+#define T_INO(name, op) \
+	static void t_##name(fuse_req_t req, fuse_ino_t ino) { \
+		struct call *c = new_call(op, req, ino, NULL); \
+		if (c) \
+			schedule(c); \
+	}
+T_INO(readlink, OP_READLINK)
+T_INO(statfs, OP_STATFS)
+
+const struct fuse_lowlevel_ops *throttle_ops(
+		const struct fuse_lowlevel_ops *ops, unsigned threads) {
+	pthread_condattr_t attr;
+	sigset_t all, old;
+	unsigned i;
+
+	if (!enabled)
+		return ops;
+
+	// Wrap just the operations that are there. Anything else, like forget,
+	// which gets no reply, is passed straight through.
+	inner = ops;
+	outer = *ops;
+#define WRAP(name) if (ops->name) outer.name = t_##name
+	WRAP(lookup);
+	WRAP(getattr);
+	WRAP(readlink);
+	WRAP(open);
+	WRAP(read);
+	WRAP(release);
+	WRAP(opendir);
+	WRAP(readdir);
+	WRAP(releasedir);
+	WRAP(statfs);
+	WRAP(access);
+#undef WRAP
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (!opts.threads)
+		opts.threads = threads ? threads : 1;
+	if (!(tids = calloc(opts.threads, sizeof(*tids)))) {
+		fprintf(stderr, "Out of mem\n");
+		exit(-1);
+	}
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < opts.threads; ++i) {
+		if (pthread_create(&tids[i], NULL, delay_worker, NULL) != 0) {
+			fprintf(stderr, "Can't start delay threads\n");
+			exit(-1);
+		}
+		++started;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return &outer;
+}
+
+void throttle_stop(void) {
+	unsigned i;
+
+	if (!started)
+		return;
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	for (i = 0; i < started; ++i)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	started = 0;
+
+	while (heap_len) {
+		struct call *c = heap_pop();
+		fuse_reply_err(c->req, EINTR);
+		free(c->name);
+		free(c);
+	}
+}
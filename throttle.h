@@ -0,0 +1,47 @@
+// (C) 2012 Dave Vasilevsky <dave@vasilevsky.ca>
+// Licensing: GPL v2, see the COPYING file
+
+// Makes a low-level filesystem behave like slow storage, set by mount options:
+//
+//   -o latency=DIST       Delay before handling each operation
+//   -o read_latency=DIST  Delay before handling each read, instead
+//   -o spike=P:MS         Also delay by MS, with probability P (0 to 1)
+//   -o bandwidth=SIZE     Most bytes read per second, like 100M
+//   -o iops=N             Most operations per second
+//   -o delay_threads=N    Threads that handle delayed operations (as many
+//                         as serve requests)
+//
+// DIST is fixed:MS, uniform:MIN:MAX or lognormal:MEDIAN:SIGMA, with times in
+// milliseconds.
+//
+// Delayed operations wait in a queue ordered by when they're due, and a
+// separate pool of threads handles them then. So the threads reading
+// requests never sleep, and one slow operation doesn't hold up the rest.
+
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <fuse_lowlevel.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Parse the options, removing them from args. Exits if they're bad.
+void throttle_init(struct fuse_args *args);
+
+// The operations to give FUSE. Without any throttling that's just ops;
+// otherwise they delay each call, then pass it on to ops. Starts the delay
+// threads if they're needed. Threads is how many serve the session, so
+// delayed calls can be handled as much in parallel as the rest.
+const struct fuse_lowlevel_ops *throttle_ops(
+	const struct fuse_lowlevel_ops *ops, unsigned threads);
+
+// Stop the delay threads, failing any operations still waiting
+void throttle_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
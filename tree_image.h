@@ -0,0 +1,784 @@
+// (C) 2012 Dave Vasilevsky <dave@vasilevsky.ca>
+// Licensing: GPL v2, see the COPYING file
+
+// On-disk format of the images written by tree_write and mounted by tree_ll.
+//
+// Version 1 is the original headerless stream of raw struct stat records,
+// which tree_ll still accepts. Version 2 is laid out so it can be mmapped
+// and used directly, without any parsing:
+//
+//   tree_header
+//   tree_inode[ninodes]     indexed by inode number; 0 is unused, 1 is root
+//   tree_dirent[ndirents]   each directory's entries are contiguous, and
+//                           sorted by name so they can be binary searched
+//   names                   entry names, back to back, not NUL-terminated
+//   hashes                  optional hash indexes of big directories
+//
+// Integers are in host byte order, and every section is 8-byte aligned.
+// A file with several links in the tree has a single inode, which all its
+// entries share, and whose link count is the number of them.
+//
+// Version 3 is the same tree, compressed. In place of the inode, entry and
+// name sections, it has blocks of inode records, each compressed with zlib
+// on its own so it can be read without the others:
+//
+//   tree_header
+//   hashes
+//   blocks                  compressed records, back to back
+//   tree_zblock[nblocks]    where each block is, and what it starts with
+//
+// There's a record for the root, and then one for each entry in order.
+// Each has the entry's name, as how much it shares with the name before
+// plus the rest; then a varint link. A link of zero means the entry has a
+// new inode, numbered after the last new one, and the inode's fields come
+// next, as zigzag varint differences from the last new inode's. A
+// directory's entries are mostly new inodes in a row, so that's usually a
+// sibling with much the same stat. Otherwise the entry is another link to
+// an inode that came before, and the link is how far back it is: the next
+// new inode's number, minus the inode's. The root has no name.
+//
+// A directory with many entries may also have a hash index, so a name can
+// be found without a binary search: a minimal perfect hash, which sends
+// each entry's name to its own slot. Each slot has a fingerprint of the
+// name it holds, so most names that aren't there are turned away without
+// looking at any entry. Images written before hash indexes existed have
+// zeroes where they'd be described, and are still valid.
+//
+// An image can also be sent as a stream, which needs no seeking to write or
+// read, so it can go through a pipe. It's written as the tree is scanned,
+// and a reader can use each directory as soon as it arrives:
+//
+//   TREE_STREAM_MAGIC
+//   tree_frame, then its payload, repeated
+//
+// The first frame is TREE_FRAME_START, with the root's tree_inode. Each
+// directory's entries come in TREE_FRAME_DIR frames, after the entry for
+// the directory itself: a tree_frame_dir, then for each entry a
+// tree_frame_entry and the name, and a tree_inode if the entry has a new
+// inode. New inodes are numbered in the order they're sent, from 2. A
+// directory with many entries is split across frames. TREE_FRAME_END, with
+// a tree_frame_end, says the stream is complete. Each payload has a CRC-32,
+// so damage is noticed. Directories that weren't sent by the end, like
+// ones that couldn't be read, are empty. Link counts are the ones the files
+// had, since a stream can't go back to fix them.
+//
+// With TREE_CONTENT, the contents of regular files are kept in a separate
+// blob file. Each distinct content is stored there once, and a file's
+// inode records where in the blob its bytes are.
+
+#ifndef TREE_IMAGE_H
+#define TREE_IMAGE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+#define TREE_MAGIC "TREEIMG"
+#define TREE_VERSION 2
+#define TREE_ZVERSION 3
+
+// Header flags
+#define TREE_CONTENT 0x1
+
+#define TREE_STREAM_MAGIC "TREESTR"
+
+struct tree_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t ninodes;
+	uint64_t ndirents;
+	uint64_t names_size;
+	uint64_t inodes_off;
+	uint64_t dirents_off;
+	uint64_t names_off;
+	uint64_t blob_size;	// With TREE_CONTENT, the size of the blob file
+	uint64_t hashes_off;
+	uint64_t hashes_size;	// Zero if there are no hash indexes
+	uint64_t nblocks;	// Version 3: blocks of inodes,
+	uint64_t blocks_off;	// and where the table of them is
+	uint64_t reserved[3];
+};
+
+struct tree_inode {
+	uint32_t mode, nlink, uid, gid;
+	uint64_t rdev, size, blocks;
+	int64_t atime, mtime, ctime;
+	uint32_t atime_ns, mtime_ns, ctime_ns, blksize;
+	uint64_t src_ino;	// Inode number in the tree that was written
+	uint64_t first;		// Directories: index of the first entry
+				// Files with TREE_CONTENT: offset in the blob
+	uint64_t count;		// Directories: number of entries
+				// Files with TREE_CONTENT: length in the blob
+	uint64_t hash;		// Directories: offset in the image of their
+				// hash index, or zero if there's none
+};
+
+struct tree_dirent {
+	uint64_t ino;
+	uint64_t name_off;
+	uint32_t name_len;
+	uint32_t reserved;
+};
+
+// Streams
+enum {
+	TREE_FRAME_START = 1,
+	TREE_FRAME_DIR,
+	TREE_FRAME_END,
+};
+
+struct tree_frame {
+	uint32_t type;
+	uint32_t size;		// Of the payload that follows
+	uint32_t crc;		// CRC-32 of the payload
+	uint32_t reserved;
+};
+
+struct tree_frame_dir {
+	uint64_t dir;		// Inode of the directory
+	uint64_t total;		// Entries it has
+	uint64_t first;		// Index of the first one in this frame
+	uint32_t count;		// Entries in this frame
+	uint32_t reserved;
+};
+
+// Entry flags
+#define TREE_ENTRY_NEW 0x1	// A tree_inode follows the name
+
+struct tree_frame_entry {
+	uint64_t ino;
+	uint32_t name_len;
+	uint32_t flags;
+};
+
+struct tree_frame_end {
+	uint64_t ninodes;
+	uint64_t ndirents;
+};
+
+// A compressed block of records
+struct tree_zblock {
+	uint64_t first_rec;	// Record 0 is the root, record N is entry N - 1
+	uint64_t first_ino;	// The first new inode from here on
+	uint64_t off;		// Where the compressed records are in the image
+	uint32_t csize;		// Size compressed
+	uint32_t usize;		// and uncompressed
+};
+
+// The most a block may decompress to. Writers aim for far less, so this
+// just stops a damaged image asking for huge buffers.
+#define TREE_ZBLOCK_MAX (1 << 20)
+
+// A directory's hash index. A name's hash picks a bucket, and the bucket's
+// displacement picks the slot, which is checked against the fingerprint.
+struct tree_hash {
+	uint32_t seed;
+	uint32_t nbuckets;
+	// Followed by uint32_t disp[nbuckets], padded to 8 bytes,
+	// then a tree_hash_slot for each entry
+};
+
+struct tree_hash_slot {
+	uint32_t entry;		// Index among the directory's entries
+	uint32_t fingerprint;
+};
+
+static inline uint64_t tree_hash_mix(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static inline uint64_t tree_hash_name(uint32_t seed, const char *p, size_t n) {
+	uint64_t h = tree_hash_mix(seed ^ (n * 0x9e3779b97f4a7c15ULL));
+	for (; n >= 8; p += 8, n -= 8) {
+		uint64_t w;
+		memcpy(&w, p, sizeof(w));
+		h = tree_hash_mix(h ^ w);
+	}
+	if (n) {
+		uint64_t w = 0;
+		memcpy(&w, p, n);
+		h = tree_hash_mix(h ^ w);
+	}
+	return h;
+}
+
+static inline uint32_t tree_hash_bucket(uint64_t h, uint32_t nbuckets) {
+	return (h >> 32) % nbuckets;
+}
+
+static inline uint32_t tree_hash_slot_of(uint64_t h, uint32_t disp,
+		uint64_t count) {
+	return tree_hash_mix(h + disp * 0x9e3779b97f4a7c15ULL) % count;
+}
+
+static inline uint32_t tree_hash_fingerprint(uint64_t h) {
+	return (uint32_t)h;
+}
+
+// Bytes taken by a directory's hash index
+static inline uint64_t tree_hash_size(uint32_t nbuckets, uint64_t count) {
+	return sizeof(tree_hash) + ((nbuckets * sizeof(uint32_t) + 7) & ~7ULL)
+		+ count * sizeof(tree_hash_slot);
+}
+
+static inline void tree_inode_from_stat(tree_inode *ti, const struct stat *st) {
+	memset(ti, 0, sizeof(*ti));
+	ti->mode = st->st_mode;
+	ti->nlink = st->st_nlink;
+	ti->uid = st->st_uid;
+	ti->gid = st->st_gid;
+	ti->rdev = st->st_rdev;
+	ti->size = st->st_size;
+	ti->blocks = st->st_blocks;
+	ti->blksize = st->st_blksize;
+	ti->atime = st->st_atim.tv_sec;
+	ti->atime_ns = st->st_atim.tv_nsec;
+	ti->mtime = st->st_mtim.tv_sec;
+	ti->mtime_ns = st->st_mtim.tv_nsec;
+	ti->ctime = st->st_ctim.tv_sec;
+	ti->ctime_ns = st->st_ctim.tv_nsec;
+	ti->src_ino = st->st_ino;
+}
+
+static inline void tree_inode_to_stat(const tree_inode *ti, uint64_t ino,
+		struct stat *st) {
+	memset(st, 0, sizeof(*st));
+	st->st_ino = ino;
+	st->st_mode = ti->mode;
+	st->st_nlink = ti->nlink;
+	st->st_uid = ti->uid;
+	st->st_gid = ti->gid;
+	st->st_rdev = ti->rdev;
+	st->st_size = ti->size;
+	st->st_blocks = ti->blocks;
+	st->st_blksize = ti->blksize;
+	st->st_atim.tv_sec = ti->atime;
+	st->st_atim.tv_nsec = ti->atime_ns;
+	st->st_mtim.tv_sec = ti->mtime;
+	st->st_mtim.tv_nsec = ti->mtime_ns;
+	st->st_ctim.tv_sec = ti->ctime;
+	st->st_ctim.tv_nsec = ti->ctime_ns;
+}
+
+// An inode's fields, in the order compressed records hold them
+#define TREE_ZFIELDS 18
+
+static inline void tree_inode_fields(const tree_inode *ti, uint64_t *f) {
+	f[0] = ti->mode;
+	f[1] = ti->nlink;
+	f[2] = ti->uid;
+	f[3] = ti->gid;
+	f[4] = ti->rdev;
+	f[5] = ti->size;
+	f[6] = ti->blocks;
+	f[7] = ti->atime;
+	f[8] = ti->mtime;
+	f[9] = ti->ctime;
+	f[10] = ti->atime_ns;
+	f[11] = ti->mtime_ns;
+	f[12] = ti->ctime_ns;
+	f[13] = ti->blksize;
+	f[14] = ti->src_ino;
+	f[15] = ti->first;
+	f[16] = ti->count;
+	f[17] = ti->hash;
+}
+
+static inline void tree_inode_from_fields(tree_inode *ti, const uint64_t *f) {
+	ti->mode = f[0];
+	ti->nlink = f[1];
+	ti->uid = f[2];
+	ti->gid = f[3];
+	ti->rdev = f[4];
+	ti->size = f[5];
+	ti->blocks = f[6];
+	ti->atime = f[7];
+	ti->mtime = f[8];
+	ti->ctime = f[9];
+	ti->atime_ns = f[10];
+	ti->mtime_ns = f[11];
+	ti->ctime_ns = f[12];
+	ti->blksize = f[13];
+	ti->src_ino = f[14];
+	ti->first = f[15];
+	ti->count = f[16];
+	ti->hash = f[17];
+}
+
+static inline uint64_t tree_zigzag(uint64_t d) {
+	return (d << 1) ^ (uint64_t)((int64_t)d >> 63);
+}
+
+static inline uint64_t tree_unzigzag(uint64_t z) {
+	return (z >> 1) ^ -(z & 1);
+}
+
+static inline void tree_put_varint(std::string& out, uint64_t v) {
+	for (; v >= 0x80; v >>= 7)
+		out += (char)(v | 0x80);
+	out += (char)v;
+}
+
+static inline bool tree_get_varint(const char **p, const char *end,
+		uint64_t *v) {
+	*v = 0;
+	for (int shift = 0; *p < end && shift < 64; shift += 7) {
+		unsigned char c = *(*p)++;
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+// The order entries are sorted in: bytewise, shorter names first on a tie.
+// This is the same order std::string uses.
+static inline int tree_name_cmp(const char *a, size_t alen,
+		const char *b, size_t blen) {
+	int r = memcmp(a, b, alen < blen ? alen : blen);
+	if (r)
+		return r;
+	return alen < blen ? -1 : alen > blen;
+}
+
+static inline bool tree_section_ok(size_t size, uint64_t off, uint64_t count,
+		uint64_t elt) {
+	return off <= size && count <= (size - off) / elt;
+}
+
+// Map an image, and check its header. Returns what went wrong, or NULL.
+static inline const char *tree_map_file(int fd, uint32_t version,
+		const char **base, size_t *size) {
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return "can't stat image";
+	*size = st.st_size;
+	if (*size < sizeof(tree_header))
+		return "image is too short";
+	void *m = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED)
+		return "can't map image";
+	madvise(m, *size, MADV_RANDOM);
+	
+	*base = (const char*)m;
+	const tree_header *hdr = (const tree_header*)m;
+	if (memcmp(hdr->magic, TREE_MAGIC, sizeof(hdr->magic)) != 0)
+		return "not an image";
+	if (hdr->version != version)
+		return "unsupported image version";
+	if (hdr->ninodes < 2
+			|| !tree_section_ok(*size, hdr->hashes_off, hdr->hashes_size, 1))
+		return "corrupt image";
+	return NULL;
+}
+
+// A directory's hash index, or NULL if it has none that's usable
+static inline const tree_hash *tree_hash_index(const char *base,
+		const tree_header *hdr, const tree_inode& d) {
+	if (!d.hash || !d.count || d.hash < hdr->hashes_off)
+		return NULL;
+	uint64_t off = d.hash - hdr->hashes_off;
+	if (hdr->hashes_size < sizeof(tree_hash)
+			|| off > hdr->hashes_size - sizeof(tree_hash))
+		return NULL;
+	const tree_hash *th = (const tree_hash*)(base + d.hash);
+	if (!th->nbuckets || (d.hash & 7)
+			|| tree_hash_size(th->nbuckets, d.count) > hdr->hashes_size - off)
+		return NULL;
+	return th;
+}
+
+// Look a name up in a directory's hash index. Returns -1 if there's no
+// index, 0 if the name isn't there, or 1 if it may be, with the index of
+// the entry that it must match.
+static inline int tree_hash_find(const char *base, const tree_header *hdr,
+		const tree_inode& d, const char *name, size_t len, uint64_t *entry) {
+	const tree_hash *th = tree_hash_index(base, hdr, d);
+	if (!th)
+		return -1;
+	const uint32_t *disp = (const uint32_t*)(th + 1);
+	const tree_hash_slot *slots = (const tree_hash_slot*)
+		((const char*)th + tree_hash_size(th->nbuckets, 0));
+	uint64_t h = tree_hash_name(th->seed, name, len);
+	const tree_hash_slot& s = slots[tree_hash_slot_of(h,
+		disp[tree_hash_bucket(h, th->nbuckets)], d.count)];
+	if (s.fingerprint != tree_hash_fingerprint(h) || s.entry >= d.count)
+		return 0;
+	*entry = s.entry;
+	return 1;
+}
+
+// What lookup returns when the image is damaged. It's never a valid inode.
+#define TREE_BAD_INO UINT64_MAX
+
+// A version 2 image, mapped into memory. Sections are checked when it's
+// opened, and what they refer to each other by is checked as it's used, so
+// a damaged image can't make us read outside it.
+struct tree_map {
+	tree_map() : base(0), size(0), hdr(0), inodes(0), dirents(0), names(0) { }
+	
+	const char *base;
+	size_t size;
+	const tree_header *hdr;
+	const tree_inode *inodes;
+	const tree_dirent *dirents;
+	const char *names;
+	
+	// Map an image. Returns what went wrong, or NULL on success.
+	const char *open(int fd) {
+		const char *err = tree_map_file(fd, TREE_VERSION, &base, &size);
+		if (err)
+			return err;
+		hdr = (const tree_header*)base;
+		if (!section_ok(hdr->inodes_off, hdr->ninodes, sizeof(tree_inode))
+				|| !section_ok(hdr->dirents_off, hdr->ndirents,
+					sizeof(tree_dirent))
+				|| !section_ok(hdr->names_off, hdr->names_size, 1)
+				|| !section_ok(hdr->hashes_off, hdr->hashes_size, 1))
+			return "corrupt image";
+		inodes = (const tree_inode*)(base + hdr->inodes_off);
+		dirents = (const tree_dirent*)(base + hdr->dirents_off);
+		names = base + hdr->names_off;
+		return NULL;
+	}
+	
+	bool section_ok(uint64_t off, uint64_t count, uint64_t elt) const {
+		return tree_section_ok(size, off, count, elt);
+	}
+	
+	// Whether a directory's entries are all in the image
+	bool entries_ok(const tree_inode& d) const {
+		return d.first <= hdr->ndirents && d.count <= hdr->ndirents - d.first;
+	}
+	
+	// Get an entry, returning false if it's damaged
+	bool entry(uint64_t i, uint64_t *ino, const char **name,
+			size_t *len) const {
+		if (i >= hdr->ndirents)
+			return false;
+		const tree_dirent& de = dirents[i];
+		if (de.ino < 1 || de.ino >= hdr->ninodes
+				|| de.name_off > hdr->names_size
+				|| de.name_len > hdr->names_size - de.name_off)
+			return false;
+		*ino = de.ino;
+		*name = names + de.name_off;
+		*len = de.name_len;
+		return true;
+	}
+	
+	// Find an entry of a directory, returning zero if there's none, or
+	// TREE_BAD_INO if the image is damaged
+	uint64_t lookup(uint64_t dir, const char *name, size_t len) const {
+		if (dir >= hdr->ninodes)
+			return TREE_BAD_INO;
+		const tree_inode& d = inodes[dir];
+		if (!S_ISDIR(d.mode))
+			return 0;
+		if (!entries_ok(d))
+			return TREE_BAD_INO;
+		uint64_t entry, ino;
+		const char *n;
+		size_t nlen;
+		int found = tree_hash_find(base, hdr, d, name, len, &entry);
+		if (found == 0)
+			return 0;
+		if (found > 0) {
+			if (!this->entry(d.first + entry, &ino, &n, &nlen))
+				return TREE_BAD_INO;
+			return tree_name_cmp(n, nlen, name, len) == 0 ? ino : 0;
+		}
+		
+		uint64_t lo = d.first, hi = d.first + d.count;
+		while (lo < hi) {
+			uint64_t mid = lo + (hi - lo) / 2;
+			if (!this->entry(mid, &ino, &n, &nlen))
+				return TREE_BAD_INO;
+			int c = tree_name_cmp(n, nlen, name, len);
+			if (c == 0)
+				return ino;
+			if (c < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return 0;
+	}
+};
+
+// A version 3 image, mapped into memory. A block is decompressed when one
+// of its records is first needed, and kept until the memory it takes is
+// needed for others; then the least recently used blocks are dropped.
+// Not safe to use from more than one thread at once.
+struct tree_zmap {
+	tree_zmap() : base(0), size(0), hdr(0), blocks(0), nrecs(0), budget(0),
+		used(0), head(0), tail(0) { }
+	~tree_zmap() {
+		while (head)
+			drop(head);
+	}
+	
+	// A decompressed block
+	struct block {
+		uint64_t index, first_rec, first_ino;
+		std::vector<uint64_t> inos;	// Each record's inode
+		std::vector<uint32_t> name_end;	// Each name ends where the next starts
+		std::string names;
+		std::vector<tree_inode> inodes;	// The new ones
+		size_t bytes;
+		block *prev, *next;	// In order of use, most recent first
+	};
+	
+	const char *base;
+	size_t size;
+	const tree_header *hdr;
+	const tree_zblock *blocks;
+	uint64_t nrecs;
+	std::vector<block*> cache;	// By index, NULL if not decompressed
+	size_t budget, used;
+	block *head, *tail;
+	
+	// Map an image, keeping at most about mem bytes of decompressed
+	// blocks. Returns what went wrong, or NULL on success.
+	const char *open(int fd, size_t mem) {
+		const char *err = tree_map_file(fd, TREE_ZVERSION, &base, &size);
+		if (err)
+			return err;
+		hdr = (const tree_header*)base;
+		nrecs = hdr->ndirents + 1;
+		if (!hdr->nblocks || !tree_section_ok(size, hdr->blocks_off,
+				hdr->nblocks, sizeof(tree_zblock)))
+			return "corrupt image";
+		blocks = (const tree_zblock*)(base + hdr->blocks_off);
+		if (blocks[0].first_rec != 0 || blocks[0].first_ino != 1)
+			return "corrupt image";
+		for (uint64_t b = 0; b < hdr->nblocks; ++b) {
+			if (recs(b) == 0 || blocks[b].first_ino > next_ino(b)
+					|| next_ino(b) > hdr->ninodes
+					|| blocks[b].usize > TREE_ZBLOCK_MAX
+					|| !tree_section_ok(size, blocks[b].off, blocks[b].csize, 1))
+				return "corrupt image";
+		}
+		cache.resize(hdr->nblocks);
+		budget = mem;
+		return NULL;
+	}
+	
+	// Records in a block, and the first new inode after it
+	uint64_t recs(uint64_t b) const {
+		uint64_t end = b + 1 < hdr->nblocks ? blocks[b + 1].first_rec : nrecs;
+		return end > blocks[b].first_rec && end <= nrecs
+			? end - blocks[b].first_rec : 0;
+	}
+	
+	uint64_t next_ino(uint64_t b) const {
+		return b + 1 < hdr->nblocks ? blocks[b + 1].first_ino : hdr->ninodes;
+	}
+	
+	// Get an inode, returning false if it can't be had
+	bool inode(uint64_t ino, tree_inode *ti) {
+		if (ino < 1 || ino >= hdr->ninodes)
+			return false;
+		block *bl = head;
+		if (!bl || ino < bl->first_ino
+				|| ino - bl->first_ino >= bl->inodes.size()) {
+			// The last block starting at or before it is the one with it,
+			// since one without new inodes starts where the next does
+			uint64_t lo = 0, hi = hdr->nblocks;
+			while (hi - lo > 1) {
+				uint64_t mid = lo + (hi - lo) / 2;
+				if (blocks[mid].first_ino <= ino)
+					lo = mid;
+				else
+					hi = mid;
+			}
+			if (!(bl = fetch(lo)))
+				return false;
+		}
+		*ti = bl->inodes[ino - bl->first_ino];
+		return true;
+	}
+	
+	// Get an entry: its inode, and its name, which stays valid until the
+	// next call
+	bool entry(uint64_t i, uint64_t *ino, const char **name, size_t *len) {
+		uint64_t rec = i + 1;
+		if (rec >= nrecs)
+			return false;
+		block *bl = head;
+		if (!bl || rec < bl->first_rec
+				|| rec - bl->first_rec >= bl->inos.size()) {
+			uint64_t lo = 0, hi = hdr->nblocks;
+			while (hi - lo > 1) {
+				uint64_t mid = lo + (hi - lo) / 2;
+				if (blocks[mid].first_rec <= rec)
+					lo = mid;
+				else
+					hi = mid;
+			}
+			if (!(bl = fetch(lo)))
+				return false;
+		}
+		uint64_t r = rec - bl->first_rec;
+		uint32_t start = r ? bl->name_end[r - 1] : 0;
+		*ino = bl->inos[r];
+		*name = bl->names.data() + start;
+		*len = bl->name_end[r] - start;
+		return true;
+	}
+	
+	// Find an entry of a directory, returning zero if there's none
+	uint64_t lookup(uint64_t dir, const char *name, size_t len) {
+		tree_inode d;
+		if (!inode(dir, &d))
+			return TREE_BAD_INO;
+		if (!S_ISDIR(d.mode))
+			return 0;
+		uint64_t entry, ino;
+		int found = tree_hash_find(base, hdr, d, name, len, &entry);
+		if (found == 0)
+			return 0;
+		if (found > 0)
+			return compare(d.first + entry, name, len, &ino) == 0 ? ino : 0;
+		
+		uint64_t lo = d.first, hi = d.first + d.count;
+		while (lo < hi) {
+			uint64_t mid = lo + (hi - lo) / 2;
+			int c = compare(mid, name, len, &ino);
+			if (c == 0)
+				return ino;
+			if (c < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return 0;
+	}
+	
+	// Compare an entry's name to another. One that can't be read sorts last.
+	int compare(uint64_t i, const char *name, size_t len, uint64_t *ino) {
+		const char *n;
+		size_t nlen;
+		if (!entry(i, ino, &n, &nlen))
+			return 1;
+		return tree_name_cmp(n, nlen, name, len);
+	}
+	
+	// Get a block, decompressing it if need be, and mark it most recently used
+	block *fetch(uint64_t b) {
+		block *bl = cache[b];
+		if (!bl) {
+			if (!(bl = decompress(b)))
+				return NULL;
+			cache[b] = bl;
+			used += bl->bytes;
+		} else {
+			unlink(bl);
+		}
+		bl->prev = NULL;
+		bl->next = head;
+		if (head)
+			head->prev = bl;
+		head = bl;
+		if (!tail)
+			tail = bl;
+		while (used > budget && tail != head)
+			drop(tail);
+		return bl;
+	}
+	
+	void unlink(block *bl) {
+		if (bl->prev)
+			bl->prev->next = bl->next;
+		else
+			head = bl->next;
+		if (bl->next)
+			bl->next->prev = bl->prev;
+		else
+			tail = bl->prev;
+	}
+	
+	void drop(block *bl) {
+		unlink(bl);
+		cache[bl->index] = NULL;
+		used -= bl->bytes;
+		delete bl;
+	}
+	
+	block *decompress(uint64_t b) {
+		const tree_zblock& zb = blocks[b];
+		std::vector<char> raw((size_t)zb.usize + 1);
+		uLongf rawlen = zb.usize;
+		if (uncompress((Bytef*)&raw[0], &rawlen, (const Bytef*)(base + zb.off),
+				zb.csize) != Z_OK || rawlen != zb.usize)
+			return NULL;
+		
+		block *bl = new block;
+		bl->index = b;
+		bl->first_rec = zb.first_rec;
+		bl->first_ino = zb.first_ino;
+		if (!decode(bl, &raw[0], &raw[0] + rawlen)) {
+			delete bl;
+			return NULL;
+		}
+		bl->bytes = sizeof(*bl)
+			+ bl->inos.size() * (sizeof(uint64_t) + sizeof(uint32_t))
+			+ bl->inodes.size() * sizeof(tree_inode) + bl->names.capacity();
+		return bl;
+	}
+	
+	bool decode(block *bl, const char *p, const char *end) {
+		uint64_t n = recs(bl->index), ino = bl->first_ino;
+		uint64_t last = next_ino(bl->index);
+		bl->inos.resize(n);
+		bl->name_end.resize(n);
+		bl->inodes.reserve(last - ino);
+		uint64_t f[TREE_ZFIELDS] = { 0 };
+		size_t prev = 0, prev_len = 0;
+		for (uint64_t i = 0; i < n; ++i) {
+			uint64_t shared, rest, link, d;
+			if (!tree_get_varint(&p, end, &shared) || shared > prev_len
+					|| !tree_get_varint(&p, end, &rest)
+					|| rest > (uint64_t)(end - p))
+				return false;
+			size_t start = bl->names.size();
+			bl->names.append(bl->names, prev, shared);
+			bl->names.append(p, rest);
+			p += rest;
+			prev = start;
+			prev_len = shared + rest;
+			bl->name_end[i] = bl->names.size();
+			
+			if (!tree_get_varint(&p, end, &link) || link >= ino)
+				return false;
+			if (link) {
+				bl->inos[i] = ino - link;
+				continue;
+			}
+			if (ino >= last)
+				return false;
+			for (int k = 0; k < TREE_ZFIELDS; ++k) {
+				if (!tree_get_varint(&p, end, &d))
+					return false;
+				f[k] += tree_unzigzag(d);
+			}
+			bl->inodes.push_back(tree_inode());
+			tree_inode_from_fields(&bl->inodes.back(), f);
+			bl->inos[i] = ino++;
+		}
+		return ino == last && p == end;
+	}
+};
+
+#endif
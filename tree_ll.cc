@@ -5,6 +5,10 @@
 
 #include <fuse_lowlevel.h>
 
+#include "tree_image.h"
+#include "stats.h"
+#include "parse_size.h"
+
 #include <cstdio>
 #include <cstdlib>
 #include <cfloat>
@@ -14,11 +18,15 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
 using std::vector;
 using std::string;
 using std::map;
 
 #include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -27,89 +35,742 @@ static void die(const char *msg) {
   exit(-1);
 }
 
-struct file {
-	struct stat st;
-	map<string, size_t> entries;
+// Orders plain structs by their bytes, so they can be keys
+struct bytes_less {
+	template <typename T>
+	bool operator()(const T& a, const T& b) const {
+		return memcmp(&a, &b, sizeof(T)) < 0;
+	}
+};
+
+// Values many inodes share, each kept once and referred to by index
+template <typename T>
+struct shared_values {
+	vector<T> values;
+	map<T, uint32_t, bytes_less> index;
 	
-	file() { }
-	file(struct stat s) : st(s) { }
-	file(const file& f) : st(f.st), entries(f.entries) { }
+	// Returns false if there are too many
+	bool add(const T& v, uint32_t *i) {
+		typename map<T, uint32_t, bytes_less>::iterator iter = index.find(v);
+		if (iter != index.end()) {
+			*i = iter->second;
+			return true;
+		}
+		if (values.size() > UINT32_MAX)
+			return false;
+		*i = index[v] = values.size();
+		values.push_back(v);
+		return true;
+	}
+	
+	// Once no more are coming, the index isn't needed
+	void done() {
+		map<T, uint32_t, bytes_less>().swap(index);
+		vector<T>(values).swap(values);
+	}
+};
+
+// A tree on the heap, for version 1 images and streams. Each column of the
+// inodes is its own array, and what's usually shared, like mode and owner,
+// or times, is kept once. Only directories have a range of entries. An
+// entry is an inode and the offset of its name, and names end with a NUL,
+// which no name can have.
+struct tree_columns {
+	struct attrs {
+		uint32_t mode, nlink, uid, gid, blksize, reserved;
+		uint64_t rdev;
+	};
+	struct times {
+		int64_t atime, mtime, ctime;
+		uint32_t atime_ns, mtime_ns, ctime_ns, reserved;
+	};
+	struct dir {
+		uint64_t ino, first, count;
+		int state;	// For streams
+	};
+	struct entry {
+		uint32_t ino, name;
+	};
+	
+	shared_values<attrs> attr_values;
+	shared_values<times> time_values;
+	vector<uint32_t> attr, time;
+	vector<uint64_t> size, blocks;
+	vector<dir> dirs;	// By inode
+	vector<entry> entries;
+	vector<char> names;
+	
+	tree_columns() {
+		tree_inode ti;
+		memset(&ti, 0, sizeof(ti));
+		add(ti);	// There's no inode zero
+	}
+	
+	uint64_t ninodes() const { return size.size(); }
+	
+	// Add an inode, returning false if there are too many
+	bool add(const tree_inode& ti) {
+		attrs a = { ti.mode, ti.nlink, ti.uid, ti.gid, ti.blksize, 0, ti.rdev };
+		times t = { ti.atime, ti.mtime, ti.ctime, ti.atime_ns, ti.mtime_ns,
+			ti.ctime_ns, 0 };
+		uint32_t ai, tii;
+		if (size.size() > UINT32_MAX || !attr_values.add(a, &ai)
+				|| !time_values.add(t, &tii))
+			return false;
+		attr.push_back(ai);
+		time.push_back(tii);
+		size.push_back(ti.size);
+		blocks.push_back(ti.blocks);
+		if (S_ISDIR(ti.mode)) {
+			dir d = { size.size() - 1, ti.first, ti.count, 0 };
+			dirs.push_back(d);
+		}
+		return true;
+	}
+	
+	void get(uint64_t ino, tree_inode *ti) const {
+		const attrs& a = attr_values.values[attr[ino]];
+		const times& t = time_values.values[time[ino]];
+		memset(ti, 0, sizeof(*ti));
+		ti->mode = a.mode;
+		ti->nlink = a.nlink;
+		ti->uid = a.uid;
+		ti->gid = a.gid;
+		ti->blksize = a.blksize;
+		ti->rdev = a.rdev;
+		ti->atime = t.atime;
+		ti->mtime = t.mtime;
+		ti->ctime = t.ctime;
+		ti->atime_ns = t.atime_ns;
+		ti->mtime_ns = t.mtime_ns;
+		ti->ctime_ns = t.ctime_ns;
+		ti->size = size[ino];
+		ti->blocks = blocks[ino];
+		const dir *d = find_dir(ino);
+		if (d) {
+			ti->first = d->first;
+			ti->count = d->count;
+		}
+	}
+	
+	uint32_t mode(uint64_t ino) const {
+		return attr_values.values[attr[ino]].mode;
+	}
+	
+	const dir *find_dir(uint64_t ino) const {
+		return const_cast<tree_columns*>(this)->find_dir(ino);
+	}
+	
+	dir *find_dir(uint64_t ino) {
+		size_t lo = 0, hi = dirs.size();
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (dirs[mid].ino == ino)
+				return &dirs[mid];
+			if (dirs[mid].ino < ino)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return NULL;
+	}
+	
+	// Add an entry, returning false if there are too many
+	bool add_entry(uint64_t ino, const char *name, size_t len) {
+		if (ino > UINT32_MAX || names.size() > UINT32_MAX
+				|| memchr(name, 0, len))
+			return false;
+		entry e = { (uint32_t)ino, (uint32_t)names.size() };
+		names.insert(names.end(), name, name + len);
+		names.push_back('\0');
+		entries.push_back(e);
+		return true;
+	}
+	
+	// Sort a directory's entries by name
+	void sort_dir(const dir& d) {
+		std::sort(entries.begin() + d.first,
+			entries.begin() + d.first + d.count, entry_less(names));
+	}
+	
+	struct entry_less {
+		const vector<char>& names;
+		entry_less(const vector<char>& n) : names(n) { }
+		bool operator()(const entry& a, const entry& b) const {
+			return strcmp(&names[a.name], &names[b.name]) < 0;
+		}
+	};
+	
+	uint64_t lookup(uint64_t ino, const char *name, size_t len) const {
+		const dir *d = find_dir(ino);
+		if (!d)
+			return 0;
+		uint64_t lo = d->first, hi = d->first + d->count;
+		while (lo < hi) {
+			uint64_t mid = lo + (hi - lo) / 2;
+			const char *n = &names[entries[mid].name];
+			int c = tree_name_cmp(n, strlen(n), name, len);
+			if (c == 0)
+				return entries[mid].ino;
+			if (c < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return 0;
+	}
+	
+	// Make inode 1 the same as another
+	void make_root(uint64_t ino) {
+		attr[1] = attr[ino];
+		time[1] = time[ino];
+		size[1] = size[ino];
+		blocks[1] = blocks[ino];
+		const dir *d = find_dir(ino);
+		if (d) {
+			dir root = *d;
+			root.ino = 1;
+			dirs.insert(dirs.begin(), root);
+		}
+	}
+	
+	// Give back what's no longer needed, once it's all here
+	void done() {
+		attr_values.done();
+		time_values.done();
+		vector<uint32_t>(attr).swap(attr);
+		vector<uint32_t>(time).swap(time);
+		vector<uint64_t>(size).swap(size);
+		vector<uint64_t>(blocks).swap(blocks);
+		vector<dir>(dirs).swap(dirs);
+		vector<entry>(entries).swap(entries);
+		vector<char>(names).swap(names);
+		malloc_trim(0);
+	}
+};
+
+static void *dup_ll_stream(void *data);
+
+static bool read_all(int fd, void *buf, size_t size) {
+	char *p = (char*)buf;
+	while (size) {
+		ssize_t r = read(fd, p, size);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		p += r;
+		size -= r;
+	}
+	return true;
+}
+
+// A request for a directory that hasn't finished arriving
+struct waiter {
+	fuse_req_t req;
+	fuse_ino_t dir;
+	string name;	// Lookups
+	bool open;	// Opendirs
+	fuse_file_info fi;
 };
 
 struct dup_ll {
-  dup_ll() : base(0), mountpoint(0) { }
+  dup_ll() : base(0), mountpoint(0), blob(0), cache(64 << 20),
+    compressed(false), heap(false), streaming(false), stream_fd(-1), stream_failed(false),
+    listing(0), ops(0), blob_fd(-1) { pthread_mutex_init(&lock, NULL); }
   const char *base;
   const char *mountpoint;
+  const char *blob;
+  size_t cache;	// Memory for decompressed blocks
+  
+  // Version 2 images are mapped and used in place. Version 1 images are
+  // read into cols, on the heap, and hdr describes them.
+  // Compressed images are decompressed a block at a time, by zimg.
+  tree_map img;
+  tree_zmap zimg;
+  bool compressed, heap;
+  tree_header hdr;
+  tree_columns cols;
+  
+  // A stream is read into cols too, by another thread, while we serve
+  // what's arrived. Requests for directories that aren't all here yet wait
+  // for them.
+  enum { DIR_UNLISTED, DIR_LISTING, DIR_LISTED };
+  bool streaming;
+  int stream_fd;
+  bool stream_failed;
+  pthread_mutex_t lock;		// Guards everything from the stream
+  uint64_t listing;		// The directory whose entries are arriving
+  map<uint64_t, vector<waiter> > waiters;
+  const fuse_lowlevel_ops *ops;	// What FUSE was given, to hand waiters to
   
-  vector<file> files;
+  // File contents, if the image has them
+  int blob_fd;
   
-  void parse() {
-	files.resize(2);
+  void load() {
+	int fd = strcmp(base, "-") == 0 ? STDIN_FILENO : open(base, O_RDONLY);
+	if (fd == -1)
+		die("can't open image");
 	
-  	int fd = open(base, O_RDONLY);
+	// Only a stream can come through a pipe
 	struct stat st;
-	while (read(fd, &st, sizeof(st))) {
-		file f(st);
+	char magic[sizeof(TREE_STREAM_MAGIC)];
+	if (fstat(fd, &st) != 0)
+		die("can't stat image");
+	bool seekable = S_ISREG(st.st_mode);
+	if ((seekable ? pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+				&& lseek(fd, sizeof(magic), SEEK_SET) != -1
+			: read_all(fd, magic, sizeof(magic)))
+			&& memcmp(magic, TREE_STREAM_MAGIC, sizeof(magic)) == 0) {
+		start_stream(fd);
+		return;
+	}
+	if (!seekable)
+		die("only a stream can be read from a pipe");
+	
+	tree_header h;
+	if (pread(fd, &h, sizeof(h), 0) == sizeof(h)
+			&& memcmp(h.magic, TREE_MAGIC, sizeof(h.magic)) == 0)
+		mmap_image(fd, h.version == TREE_ZVERSION);
+	else
+		parse(fd);
+	close(fd);
+  }
+  
+  void mmap_image(int fd, bool z) {
+	compressed = z;
+	const char *err = z ? zimg.open(fd, cache) : img.open(fd);
+	if (err)
+		die(err);
+	
+	struct stat st;
+	if (header()->flags & TREE_CONTENT) {
+		if (!blob)
+			die("image has file contents, use -o blob=FILE");
+		if ((blob_fd = open(blob, O_RDONLY)) == -1)
+			die("can't open blob");
+		if (fstat(blob_fd, &st) != 0
+				|| (uint64_t)st.st_size < header()->blob_size)
+			die("blob is too short");
+	}
+  }
+  
+  // A version 1 image is a stream of records, each a struct stat and, for
+  // directories, a list of (name length, inode, name) ending with a zero
+  // length. Inodes are numbered from 2 in order, and the root comes last.
+  void parse(int fd) {
+	struct stat fst;
+	if (fstat(fd, &fst) != 0)
+		die("can't stat image");
+	size_t size = fst.st_size, pos = 0;
+	void *m = mmap(NULL, size ? size : 1, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m == MAP_FAILED)
+		die("can't map image");
+	madvise(m, size, MADV_SEQUENTIAL);
+	const char *p = (const char*)m;
+	
+	heap = true;
+	tree_inode ti;
+	memset(&ti, 0, sizeof(ti));
+	cols.add(ti);	// The root goes here, once we have it
+	while (pos < size) {
+		struct stat st;
+		if (size - pos < sizeof(st))
+			die("corrupt image");
+		memcpy(&st, p + pos, sizeof(st));
+		pos += sizeof(st);
+		
+		tree_inode_from_stat(&ti, &st);
 		if (S_ISDIR(st.st_mode)) {
+			ti.first = cols.entries.size();
 			unsigned short len;
-			while (read(fd, &len, sizeof(len))) {
+			while (size - pos >= sizeof(len)) {
+				memcpy(&len, p + pos, sizeof(len));
+				pos += sizeof(len);
 				if (len == 0)
 					break;
+				
 				size_t ino;
-				read(fd, &ino, sizeof(ino));
-				vector<char> buf(len);
-				read(fd, &buf[0], len);
-				string name(&buf[0], len);
-				f.entries[name] = ino;
+				if (size - pos < sizeof(ino) + len)
+					die("corrupt image");
+				memcpy(&ino, p + pos, sizeof(ino));
+				pos += sizeof(ino);
+				if (!cols.add_entry(ino, p + pos, len))
+					die("image is too big");
+				pos += len;
 			}
+			ti.count = cols.entries.size() - ti.first;
 		}
-		files.push_back(f);
+		if (!cols.add(ti))
+			die("image is too big");
+		if (S_ISDIR(st.st_mode))
+			cols.sort_dir(cols.dirs.back());
 	}
+	munmap(m, size ? size : 1);
+	if (cols.ninodes() < 3)
+		die("image is empty");
+	cols.make_root(cols.ninodes() - 1);
+	cols.done();
 	
-	files[1] = files.back();
-	close(fd);
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TREE_MAGIC, sizeof(hdr.magic));
+	hdr.version = 1;
+	update();
+  }
+  
+  // Read the start of a stream, and leave the rest to another thread
+  void start_stream(int fd) {
+	streaming = true;
+	stream_fd = fd;
+	tree_frame f;
+	vector<char> payload;
+	tree_inode root;
+	if (!read_frame(&f, &payload) || f.type != TREE_FRAME_START
+			|| payload.size() != sizeof(root))
+		die("corrupt stream");
+	memcpy(&root, &payload[0], sizeof(root));
+	root.first = root.count = 0;
+	heap = true;
+	cols.add(root);
+	
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TREE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TREE_VERSION;
+	update();
+	
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, dup_ll_stream, this) != 0)
+		die("can't start stream thread");
+	pthread_detach(thread);
+  }
+  
+  bool read_frame(tree_frame *f, vector<char> *payload) {
+	if (!read_all(stream_fd, f, sizeof(*f)) || f->size > (1 << 30))
+		return false;
+	payload->resize(f->size);
+	if (f->size && !read_all(stream_fd, &(*payload)[0], f->size))
+		return false;
+	return crc32(0, (const Bytef*)&(*payload)[0], f->size) == f->crc;
+  }
+  
+  // Describe what's on the heap, after it's grown
+  void update() {
+	hdr.ninodes = cols.ninodes();
+	hdr.ndirents = cols.entries.size();
+	hdr.names_size = cols.names.size();
+  }
+  
+  // Called on the stream thread
+  void read_stream() {
+	tree_frame f;
+	vector<char> payload;
+	vector<waiter> ready;
+	bool ok = true, done = false;
+	while (ok && !done) {
+		ok = read_frame(&f, &payload);
+		pthread_mutex_lock(&lock);
+		if (ok && f.type == TREE_FRAME_DIR)
+			ok = add_entries(payload, &ready);
+		else if (ok && f.type == TREE_FRAME_END)
+			ok = done = finish(payload, &ready);
+		else
+			ok = false;
+		if (!ok) {
+			stream_failed = true;
+			take_waiters(&ready);
+		}
+		update();
+		pthread_mutex_unlock(&lock);
+		
+		// Now the requests can be answered. They go through the ops FUSE
+		// has, so they're counted in the stats.
+		for (size_t i = 0; i < ready.size(); ++i) {
+			waiter& w = ready[i];
+			if (w.open)
+				ops->opendir(w.req, w.dir, &w.fi);
+			else
+				ops->lookup(w.req, w.dir, w.name.c_str());
+		}
+		ready.clear();
+	}
+	if (!ok)
+		fprintf(stderr, "stream is corrupt or cut short\n");
+	if (stream_fd != STDIN_FILENO)
+		close(stream_fd);
+  }
+  
+  // Add a frame of a directory's entries. The frames of one directory come
+  // together, in order.
+  bool add_entries(const vector<char>& payload, vector<waiter> *ready) {
+	tree_frame_dir fd;
+	if (payload.size() < sizeof(fd))
+		return false;
+	memcpy(&fd, &payload[0], sizeof(fd));
+	tree_columns::dir *dir = cols.find_dir(fd.dir);
+	if (!dir)
+		return false;
+	if (fd.first == 0 && !listing && dir->state == DIR_UNLISTED) {
+		dir->first = cols.entries.size();
+		dir->state = DIR_LISTING;
+		listing = fd.dir;
+	} else if (listing != fd.dir || fd.first != dir->count) {
+		return false;
+	}
+	if (fd.count > fd.total - fd.first)
+		return false;
+	
+	const char *p = &payload[sizeof(fd)], *end = &payload[0] + payload.size();
+	for (uint32_t i = 0; i < fd.count; ++i) {
+		tree_frame_entry e;
+		if ((size_t)(end - p) < sizeof(e))
+			return false;
+		memcpy(&e, p, sizeof(e));
+		p += sizeof(e);
+		if ((size_t)(end - p) < e.name_len
+				|| !cols.add_entry(e.ino, p, e.name_len))
+			return false;
+		p += e.name_len;
+		
+		// New inodes come in order, and links are to files we've seen
+		if (e.flags & TREE_ENTRY_NEW) {
+			tree_inode ti;
+			if (e.ino != cols.ninodes() || (size_t)(end - p) < sizeof(ti))
+				return false;
+			memcpy(&ti, p, sizeof(ti));
+			p += sizeof(ti);
+			ti.first = ti.count = 0;
+			if (!cols.add(ti))
+				return false;
+		} else if (e.ino < 2 || e.ino >= cols.ninodes()
+				|| S_ISDIR(cols.mode(e.ino))) {
+			return false;
+		}
+	}
+	if (p != end)
+		return false;
+	
+	// dirs may have moved
+	dir = cols.find_dir(fd.dir);
+	dir->count += fd.count;
+	if (dir->count == fd.total)
+		list(dir, ready);
+	return true;
+  }
+  
+  // A directory has all its entries
+  void list(tree_columns::dir *dir, vector<waiter> *ready) {
+	cols.sort_dir(*dir);
+	dir->state = DIR_LISTED;
+	listing = 0;
+	map<uint64_t, vector<waiter> >::iterator iter = waiters.find(dir->ino);
+	if (iter != waiters.end()) {
+		ready->insert(ready->end(), iter->second.begin(), iter->second.end());
+		waiters.erase(iter);
+	}
+  }
+  
+  // The stream is over. Directories we never got are empty.
+  bool finish(const vector<char>& payload, vector<waiter> *ready) {
+	tree_frame_end end;
+	if (listing || payload.size() != sizeof(end))
+		return false;
+	memcpy(&end, &payload[0], sizeof(end));
+	if (end.ninodes != cols.ninodes() || end.ndirents != cols.entries.size())
+		return false;
+	for (size_t i = 0; i < cols.dirs.size(); ++i) {
+		tree_columns::dir& d = cols.dirs[i];
+		if (d.state != DIR_LISTED) {
+			d.first = cols.entries.size();
+			d.state = DIR_LISTED;
+		}
+	}
+	cols.done();
+	take_waiters(ready);
+	return true;
+  }
+  
+  void take_waiters(vector<waiter> *ready) {
+	map<uint64_t, vector<waiter> >::iterator iter;
+	for (iter = waiters.begin(); iter != waiters.end(); ++iter)
+		ready->insert(ready->end(), iter->second.begin(), iter->second.end());
+	waiters.clear();
+  }
+  
+  // If a request needs a directory that hasn't all arrived, keep it until it
+  // has, and return true. Fail it if it never will.
+  bool wait(fuse_req_t req, fuse_ino_t dir, const char *name,
+		  fuse_file_info *fi) {
+	if (!streaming)
+		return false;
+	pthread_mutex_lock(&lock);
+	const tree_columns::dir *d = cols.find_dir(dir);
+	bool listed = !d || d->state == DIR_LISTED;
+	bool failed = !listed && stream_failed;
+	if (!listed && !failed) {
+		waiter w;
+		w.req = req;
+		w.dir = dir;
+		w.open = !name;
+		if (name)
+			w.name = name;
+		else
+			w.fi = *fi;
+		waiters[dir].push_back(w);
+		stats_defer();
+	}
+	pthread_mutex_unlock(&lock);
+	if (failed)
+		fuse_reply_err(req, EIO);
+	return !listed;
+  }
+  
+  void lock_stream() {
+	if (streaming)
+		pthread_mutex_lock(&lock);
+  }
+  
+  void unlock_stream() {
+	if (streaming)
+		pthread_mutex_unlock(&lock);
+  }
+  
+  const tree_header *header() {
+	return compressed ? zimg.hdr : heap ? &hdr : img.hdr;
+  }
+  
+  bool valid(fuse_ino_t ino) {
+	lock_stream();
+	bool ok = ino >= 1 && ino < header()->ninodes;
+	unlock_stream();
+	return ok;
+  }
+  
+  // Get an inode, returning false if it can't be had
+  bool inode(fuse_ino_t ino, tree_inode *ti) {
+	if (compressed)
+		return ino >= 1 && ino < header()->ninodes && zimg.inode(ino, ti);
+	lock_stream();
+	bool ok = ino >= 1 && ino < header()->ninodes;
+	if (ok && heap)
+		cols.get(ino, ti);
+	else if (ok)
+		*ti = img.inodes[ino];
+	unlock_stream();
+	return ok;
+  }
+  
+  bool stat(fuse_ino_t ino, struct stat *st) {
+	tree_inode ti;
+	if (!inode(ino, &ti))
+		return false;
+	tree_inode_to_stat(&ti, ino, st);
+	return true;
+  }
+  
+  // Get an entry of a directory, by its index among all entries. Returns
+  // false if it's damaged.
+  bool entry(uint64_t i, uint64_t *ino, string *name) {
+	const char *n;
+	size_t len;
+	bool ok;
+	if (compressed) {
+		ok = zimg.entry(i, ino, &n, &len);
+		if (ok)
+			name->assign(n, len);
+	} else if (heap) {
+		lock_stream();
+		ok = i < cols.entries.size();
+		if (ok) {
+			const tree_columns::entry& e = cols.entries[i];
+			*ino = e.ino;
+			name->assign(&cols.names[e.name]);
+		}
+		unlock_stream();
+	} else {
+		ok = img.entry(i, ino, &n, &len);
+		if (ok)
+			name->assign(n, len);
+	}
+	return ok && valid(*ino);
+  }
+  
+  // Find an entry of a directory, returning zero if there's none, or an
+  // invalid inode if the image is damaged
+  size_t lookup(fuse_ino_t parent, const char *name) {
+	if (compressed)
+		return zimg.lookup(parent, name, strlen(name));
+	lock_stream();
+	size_t ino = heap ? cols.lookup(parent, name, strlen(name))
+		: img.lookup(parent, name, strlen(name));
+	unlock_stream();
+	return ino;
   }
 };
 
+static void *dup_ll_stream(void *data) {
+	((dup_ll*)data)->read_stream();
+	return NULL;
+}
+
 static void dup_ll_getattr(fuse_req_t req, fuse_ino_t ino,
 		struct fuse_file_info *fi) {
 	dup_ll* dup = (dup_ll*)fuse_req_userdata(req);
-	fuse_reply_attr(req, &dup->files[ino].st, DBL_MAX);
+	struct stat st;
+	if (!dup->stat(ino, &st)) {
+		fuse_reply_err(req, EIO);
+		return;
+	}
+	fuse_reply_attr(req, &st, DBL_MAX);
 }
 
 static void dup_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
 	dup_ll* dup = (dup_ll*)fuse_req_userdata(req);
-	map<string, size_t>& es = dup->files[parent].entries;
-	map<string, size_t>::iterator iter = es.find(name);
-	if (iter == es.end()) {
-	    fuse_reply_err(req, ENOENT);
+	if (dup->wait(req, parent, name, NULL))
+		return;
+	size_t ino = dup->lookup(parent, name);
+	if (ino && !dup->valid(ino)) {
+	    fuse_reply_err(req, EIO);
 	    return;
 	}
-	
+
+	// The image never changes, so the kernel can remember that a name
+	// isn't there, just like one that is
 	fuse_entry_param e;
-	size_t ino = iter->second;
     memset(&e, 0, sizeof(e));
     e.attr_timeout = e.entry_timeout = DBL_MAX;
-	e.attr = dup->files[ino].st;
+	if (ino && !dup->stat(ino, &e.attr)) {
+		fuse_reply_err(req, EIO);
+		return;
+	}
     e.ino = ino;
 	fuse_reply_entry(req, &e);
 }
 
+// An open directory. The offset of an entry is its index in the directory,
+// so a reply can be resumed from anywhere.
 struct diriter {
-	map<string, size_t>::iterator iter, end;
-	diriter(map<string, size_t>& es) : iter(es.begin()), end(es.end()) { }
+	uint64_t pos, first, count;
+	vector<char> buf;
+	diriter(const tree_inode& dir) : pos(0), first(dir.first),
+		count(dir.count) { }
 };
 
 static void dup_ll_opendir(fuse_req_t req, fuse_ino_t ino,
 		struct fuse_file_info *fi) {
 	dup_ll* dup = (dup_ll*)fuse_req_userdata(req);
-	file& f = dup->files[ino];
-	if (!S_ISDIR(f.st.st_mode)) {
+	if (dup->wait(req, ino, NULL, fi))
+		return;
+	tree_inode ti;
+	if (!dup->inode(ino, &ti)) {
+		fuse_reply_err(req, EIO);
+		return;
+	}
+	if (!S_ISDIR(ti.mode)) {
 		fuse_reply_err(req, ENOTDIR);
 		return;
 	}
 	
-	fi->fh = (intptr_t)new diriter(f.entries);
+	fi->fh = (intptr_t)new diriter(ti);
 	fuse_reply_open(req, fi);
 }
 
@@ -121,22 +782,39 @@ static void dup_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
 
 static void dup_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 		off_t off, struct fuse_file_info *fi) {
+	dup_ll* dup = (dup_ll*)fuse_req_userdata(req);
 	diriter *di = (diriter*)fi->fh;
-	if (di->iter == di->end) {
-		fuse_reply_buf(req, NULL, 0);
-		return;
+	if (off < 0 || (uint64_t)off > di->count)
+		off = di->count;
+	di->pos = off;
+	
+	di->buf.resize(size);
+	size_t used = 0;
+	for (; di->pos < di->count; ++di->pos) {
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		uint64_t eino;
+		string name; // Mapped names aren't terminated
+		tree_inode ti;
+		if (!dup->entry(di->first + di->pos, &eino, &name)) {
+			if (!used) {
+				fuse_reply_err(req, EIO);
+				return;
+			}
+			break;
+		}
+		st.st_ino = eino;
+		if (dup->inode(eino, &ti))
+			st.st_mode = ti.mode;
+		
+		size_t sz = fuse_add_direntry(req, &di->buf[used], size - used, name.c_str(),
+			&st, di->pos + 1);
+		if (sz > size - used)
+			break;
+		used += sz;
 	}
-	 
-	struct stat st;
-	memset(&st, 0, sizeof(st));
-	st.st_ino = di->iter->second;
-	
-	const char *name = di->iter->first.c_str();
-	size_t sz = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
-	vector<char> buf(sz);
-	fuse_add_direntry(req, &buf[0], sz, name, &st, off + sz);
-	++di->iter;
-	fuse_reply_buf(req, &buf[0], sz);
+	stats_reply(used);
+	fuse_reply_buf(req, &di->buf[0], used);
 }
 
 static void dup_ll_open(fuse_req_t req, fuse_ino_t ino,
@@ -155,12 +833,73 @@ static void dup_ll_release(fuse_req_t req, fuse_ino_t ino,
 
 static void dup_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
     off_t off, struct fuse_file_info *fi) {
-  fuse_reply_buf(req, NULL, 0);
+  dup_ll* dup = (dup_ll*)fuse_req_userdata(req);
+  tree_inode ti;
+  if (dup->blob_fd == -1 || !dup->inode(ino, &ti) || !S_ISREG(ti.mode)
+      || (uint64_t)off >= ti.count) {
+    fuse_reply_buf(req, NULL, 0);
+    return;
+  }
+  
+  // A damaged image mustn't send us anywhere else in the blob
+  uint64_t blob_size = dup->header()->blob_size;
+  if (ti.first > blob_size || ti.count > blob_size - ti.first) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  
+  if (size > ti.count - off)
+    size = ti.count - off;
+#if FUSE_VERSION >= 29
+  struct fuse_bufvec buf;
+  memset(&buf, 0, sizeof(buf));
+  buf.count = 1;
+  buf.buf[0].size = size;
+  buf.buf[0].flags = (fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+  buf.buf[0].fd = dup->blob_fd;
+  buf.buf[0].pos = ti.first + off;
+  stats_reply(size);
+  fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+#else
+  vector<char> buf(size);
+  ssize_t r = pread(dup->blob_fd, &buf[0], size, ti.first + off);
+  if (r == -1) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  stats_reply(r);
+  fuse_reply_buf(req, &buf[0], r);
+#endif
+}
+
+static void dup_ll_init(void *userdata, struct fuse_conn_info *conn) {
+#if FUSE_VERSION >= 29
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#endif
 }
 
+enum {
+  KEY_BLOB,
+  KEY_CACHE,
+};
+
+static struct fuse_opt dup_ll_opts[] = {
+  FUSE_OPT_KEY("blob=", KEY_BLOB),
+  FUSE_OPT_KEY("cache=", KEY_CACHE),
+  FUSE_OPT_END
+};
+
 static int dup_ll_opt_proc(void *data, const char *arg, int key,
 		struct fuse_args *outargs) {
 	dup_ll *dup = (dup_ll*)data;
+	if (key == KEY_BLOB) {
+		dup->blob = strdup(arg + strlen("blob="));
+		return 0;
+	}
+	if (key == KEY_CACHE) {
+		dup->cache = parse_size(arg + strlen("cache="), NULL);
+		return 0;
+	}
 	if (key == FUSE_OPT_KEY_NONOPT) {
 		if (dup->mountpoint) {
 			return -1; // Too many args
@@ -168,7 +907,8 @@ static int dup_ll_opt_proc(void *data, const char *arg, int key,
       dup->mountpoint = arg;
 			return 1;
 		} else {
-			dup->base = realpath(arg, NULL);
+			// An image can come from stdin, if it's a stream
+			dup->base = strcmp(arg, "-") == 0 ? "-" : realpath(arg, NULL);
 			return 0;
 		}
 	}
@@ -178,6 +918,7 @@ static int dup_ll_opt_proc(void *data, const char *arg, int key,
 int main(int argc, char *argv[]) {
 	struct fuse_lowlevel_ops ops;
 	memset(&ops, 0, sizeof(ops));
+	ops.init		= dup_ll_init;
 	ops.lookup		= dup_ll_lookup;
 	ops.getattr	= dup_ll_getattr;
 	ops.opendir	= dup_ll_opendir;
@@ -193,15 +934,17 @@ int main(int argc, char *argv[]) {
 	int err = -1;
 
 	dup_ll ll;
-  if (fuse_opt_parse(&args, &ll, NULL, dup_ll_opt_proc) == -1)
+  if (fuse_opt_parse(&args, &ll, dup_ll_opts, dup_ll_opt_proc) == -1)
     die("bad opts");
-  ll.parse();
+  ll.load();
+  stats_init(&args, NULL);
   
   if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) != -1 &&
 	    (ch = fuse_mount(mountpoint, &args)) != NULL) {
 		struct fuse_session *se;
 
-    se = fuse_lowlevel_new(&args, &ops, sizeof(ops), &ll);
+    ll.ops = stats_ops(&ops);
+    se = fuse_lowlevel_new(&args, ll.ops, sizeof(ops), &ll);
 		if (se != NULL) {
 			if (fuse_set_signal_handlers(se) != -1) {
 				fuse_session_add_chan(se, ch);
@@ -1,72 +1,1071 @@
 // (C) 2012 Dave Vasilevsky <dave@vasilevsky.ca>
 // Licensing: GPL v2, see the COPYING file
 
+#include "tree_image.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <climits>
+#include <csignal>
+
 #include <vector>
 #include <string>
+#include <map>
+#include <set>
+#include <deque>
+#include <algorithm>
 using std::vector;
 using std::string;
+using std::map;
+using std::multimap;
 
 #include <sys/stat.h>
-#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <unistd.h>
 
-int fd;
-size_t ino = 2;
+static void remove_outputs();
+
+static void die(const char *msg) {
+	perror(msg);
+	remove_outputs();
+	exit(-1);
+}
+
+// How many things couldn't be read. The image is still written, without
+// them, but the run fails at the end.
+unsigned long read_errors = 0;
+
+static void read_error(const string &path) {
+	int err = errno;
+	fprintf(stderr, "%s: %s\n", path.c_str(), strerror(err));
+	__sync_fetch_and_add(&read_errors, 1);
+}
+
+
+// Output goes to a temporary file next to its destination, which is renamed
+// into place only once it's complete, so a failed or interrupted run never
+// leaves a partial image behind. Small writes are gathered into a buffer,
+// and written along with the next large one in a single writev().
+struct output {
+	output() : fd(-1), used(0), next(NULL), stream(false) { }
+	
+	string path;
+	char tmp[PATH_MAX];
+	int fd;
+	vector<char> buf;
+	size_t used;
+	output *next;
+	bool stream;
+	
+	void open(const char *dest);
+	void open_stream(const char *dest);
+	void write(const void *data, size_t size);
+	void flush(const void *data = NULL, size_t size = 0);
+	void commit();
+};
+
+output *outputs = NULL; // All uncommitted outputs
+const size_t output_buffer = 1 << 20;
 
-struct entry {
-	size_t ino;
+static void remove_outputs() {
+	for (output *o = outputs; o; o = o->next)
+		unlink(o->tmp);
+}
+
+static void interrupted(int sig) {
+	remove_outputs();
+	_exit(128 + sig);
+}
+
+static void writev_all(int fd, struct iovec *iov, int count) {
+	while (count) {
+		ssize_t r = writev(fd, iov, count);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			die("write");
+		}
+		for (; count && (size_t)r >= iov->iov_len; ++iov, --count)
+			r -= iov->iov_len;
+		if (count) {
+			iov->iov_base = (char*)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+}
+
+void output::open(const char *dest) {
+	path = dest;
+	if (path.size() + 8 > sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		die(dest);
+	}
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", dest);
+	if ((fd = mkstemp(tmp)) == -1)
+		die(dest);
+	next = outputs;
+	outputs = this;
+	
+	// mkstemp() makes private files, but an image should be like any other
+	mode_t mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+	buf.resize(output_buffer);
+}
+
+// A stream is written straight to its destination, which may be a pipe,
+// or standard output if it's "-". A reader notices if it's cut short.
+void output::open_stream(const char *dest) {
+	path = dest;
+	stream = true;
+	if (path == "-")
+		fd = STDOUT_FILENO;
+	else if ((fd = ::open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+		die(dest);
+	buf.resize(output_buffer);
+}
+
+void output::write(const void *data, size_t size) {
+	if (used + size <= buf.size()) {
+		memcpy(&buf[used], data, size);
+		used += size;
+	} else {
+		flush(data, size);
+	}
+}
+
+// Write out the buffer, plus some more data
+void output::flush(const void *data, size_t size) {
+	struct iovec iov[2];
+	int count = 0;
+	if (used) {
+		iov[count].iov_base = &buf[0];
+		iov[count++].iov_len = used;
+	}
+	if (size) {
+		iov[count].iov_base = (void*)data;
+		iov[count++].iov_len = size;
+	}
+	writev_all(fd, iov, count);
+	used = 0;
+}
+
+void output::commit() {
+	flush();
+	if (stream) {
+		if (close(fd) != 0)
+			die(path.c_str());
+		return;
+	}
+	if (fsync(fd) != 0 || close(fd) != 0 || rename(tmp, path.c_str()) != 0)
+		die(path.c_str());
+	for (output **o = &outputs; *o; o = &(*o)->next) {
+		if (*o == this) {
+			*o = next;
+			break;
+		}
+	}
+}
+
+// Read as much as fits in the buffer, stopping short only at the end.
+// Returns -1 on an error.
+static ssize_t read_full(int fd, char *buf, size_t size) {
+	size_t done = 0;
+	while (done < size) {
+		ssize_t r = read(fd, buf + done, size - done);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1)
+			return -1;
+		if (r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+
+// File contents, if we're storing them. Each distinct content goes in the
+// blob once. Contents are found by hash, and compared in full before being
+// shared, so the hash needn't be strong.
+output blob_out;
+int blob_fd = -1;	// Written at random, so not through the buffer
+uint64_t blob_size = 0;
+multimap<uint64_t, uint64_t> blob_hashes; // Hash to blob offset
+const size_t blob_chunk = 1 << 20;
+
+static uint64_t hash_bytes(uint64_t h, const char *p, size_t n) {
+	const uint64_t k = 0x9e3779b97f4a7c15ULL;
+	for (; n >= 8; p += 8, n -= 8) {
+		uint64_t w;
+		memcpy(&w, p, sizeof(w));
+		h = ((h ^ w) * k) ^ (h >> 29);
+	}
+	for (; n; ++p, --n)
+		h = ((h ^ (unsigned char)*p) * k) ^ (h >> 29);
+	return h;
+}
+
+static bool blob_equal(uint64_t a, uint64_t b, uint64_t len) {
+	vector<char> bufa(blob_chunk), bufb(blob_chunk);
+	while (len) {
+		size_t n = len < blob_chunk ? len : blob_chunk;
+		if (pread(blob_fd, &bufa[0], n, a) != (ssize_t)n
+				|| pread(blob_fd, &bufb[0], n, b) != (ssize_t)n)
+			die("blob read");
+		if (memcmp(&bufa[0], &bufb[0], n) != 0)
+			return false;
+		a += n;
+		b += n;
+		len -= n;
+	}
+	return true;
+}
+
+// Copy a file's contents to the blob, unless they're there already
+static void store_contents(const string &path, tree_inode *ti) {
+	int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW);
+	if (fd == -1) {
+		read_error(path);
+		return;
+	}
+	
+	uint64_t start = blob_size;
+	uint64_t h = 0;
+	vector<char> buf(blob_chunk);
+	ssize_t n;
+	while ((n = read_full(fd, &buf[0], buf.size())) > 0) {
+		h = hash_bytes(h, &buf[0], n);
+		if (pwrite(blob_fd, &buf[0], n, blob_size) != n)
+			die("blob write");
+		blob_size += n;
+	}
+	if (n == -1)
+		read_error(path);
+	close(fd);
+	
+	uint64_t len = blob_size - start;
+	h ^= len;
+	ti->count = len;
+	ti->first = start;
+	if (len == 0)
+		return;
+	
+	multimap<uint64_t, uint64_t>::iterator iter = blob_hashes.lower_bound(h);
+	for (; iter != blob_hashes.end() && iter->first == h; ++iter) {
+		if (blob_equal(iter->second, start, len)) {
+			ti->first = iter->second;
+			blob_size = start;
+			if (ftruncate(blob_fd, blob_size) != 0)
+				die("blob truncate");
+			return;
+		}
+	}
+	blob_hashes.insert(std::make_pair(h, start));
+}
+
+// The tree as scanned, before it's numbered and written out
+struct node {
+	node(node *p, const string& n) : parent(p), name(n), base(0), dev(0),
+			ino(0), fd(-1), pending(0) {
+		memset(&ti, 0, sizeof(ti));
+	}
+	~node() {
+		for (size_t i = 0; i < kids.size(); ++i)
+			delete kids[i];
+	}
+	
+	node *parent;
 	string name;
-	entry(size_t i, string n) : ino(i), name(n) { }
+	tree_inode ti;
+	vector<node*> kids; // Sorted by name
+	uint64_t base;      // Directories: our inode in the base image, if any
+	uint64_t dev;       // The device we're on
+	uint64_t ino;       // Streaming: our inode in the image
+	
+	// While scanning: our directory, and how many subdirectories still need
+	// it to open themselves
+	int fd;
+	unsigned long pending;
+};
+
+static bool node_less(const node *a, const node *b) {
+	return a->name < b->name;
+}
+
+
+static void stream_dir(node *n);
+output *stream_out = NULL;	// If we're streaming
+
+// A previous image of the tree. Directories that haven't changed since are
+// copied from it, rather than scanned again.
+tree_map base_img;
+
+// Files are known by device and inode
+typedef std::pair<uint64_t, uint64_t> link_key;
+
+// Files with more than one link that were scanned, when there's a base
+// image. A file copied from the base has the link count it had then, so a
+// link made to it since is only noticed by being here.
+std::set<link_key> scanned_links;
+pthread_mutex_t scanned_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Directories are scanned by a pool of workers. Each has its own queue, and
+// takes its most recent task first so it works depth-first, keeping few
+// directories open. Idle workers steal the oldest tasks of others.
+struct worker {
+	pthread_mutex_t lock;
+	std::deque<node*> tasks;
+};
+
+vector<worker> workers;
+unsigned long queued = 0;	// Tasks sitting in queues
+unsigned long unfinished = 0;	// Tasks queued or being scanned
+pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static void push_task(size_t w, node *n) {
+	__sync_fetch_and_add(&unfinished, 1);
+	__sync_fetch_and_add(&queued, 1);
+	pthread_mutex_lock(&workers[w].lock);
+	workers[w].tasks.push_back(n);
+	pthread_mutex_unlock(&workers[w].lock);
 	
-	void write_entry(int fd) {
-		unsigned short len = name.size();
-		write(fd, &len, sizeof(len));
-		write(fd, &ino, sizeof(ino));
-		write(fd, name.c_str(), len);
+	pthread_mutex_lock(&idle_lock);
+	pthread_cond_signal(&idle_cond);
+	pthread_mutex_unlock(&idle_lock);
+}
+
+static node *pop_task(size_t w) {
+	for (size_t i = 0; i < workers.size(); ++i) {
+		worker& v = workers[(w + i) % workers.size()];
+		node *n = NULL;
+		pthread_mutex_lock(&v.lock);
+		if (!v.tasks.empty()) {
+			if (i == 0) {
+				n = v.tasks.back();
+				v.tasks.pop_back();
+			} else {
+				n = v.tasks.front();
+				v.tasks.pop_front();
+			}
+		}
+		pthread_mutex_unlock(&v.lock);
+		if (n) {
+			__sync_fetch_and_sub(&queued, 1);
+			return n;
+		}
+	}
+	return NULL;
+}
+
+static void finish_task() {
+	if (__sync_sub_and_fetch(&unfinished, 1) == 0) {
+		pthread_mutex_lock(&idle_lock);
+		pthread_cond_broadcast(&idle_cond);
+		pthread_mutex_unlock(&idle_lock);
 	}
+}
+
+// Done with a directory's descriptor, if its subdirectories are too
+static void release_dir(node *n) {
+	if (__sync_sub_and_fetch(&n->pending, 1) == 0)
+		close(n->fd);
+}
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
 };
 
-size_t write_path(string &dir, char *sub) {
-	string path(dir);
-	if (sub)
-		path = path + "/" + sub;
-	struct stat st;
-	lstat(path.c_str(), &st);
-	
-	vector<entry> entries;
-	bool is_dir = S_ISDIR(st.st_mode);
-	if (is_dir) {
-		DIR *d = opendir(path.c_str());
-		if (d) {
-			struct dirent *de;
-			while ((de = readdir(d))) {
-				if (string(".") == de->d_name || string("..") == de->d_name)
-					continue;
-				entries.push_back(
-					entry(write_path(path, de->d_name), de->d_name));
+// Queue up the subdirectories of a directory that's been listed
+static void queue_subdirs(size_t w, node *n, int fd) {
+	// Hold the descriptor until every subdirectory has opened itself
+	n->fd = fd;
+	n->pending = 1;
+	for (size_t i = n->kids.size(); i-- > 0; ) {
+		if (S_ISDIR(n->kids[i]->ti.mode)) {
+			__sync_fetch_and_add(&n->pending, 1);
+			push_task(w, n->kids[i]);
+		}
+	}
+	release_dir(n);
+}
+
+// The directory being scanned
+string scan_root;
+
+static string node_path(const node *n) {
+	return n->parent ? node_path(n->parent) + "/" + n->name : scan_root;
+}
+
+static void scan_dir(size_t w, node *n, int fd) {
+	vector<char> buf(1 << 16);
+	long r;
+	while ((r = syscall(SYS_getdents64, fd, &buf[0], buf.size())) > 0) {
+		for (long pos = 0; pos < r; ) {
+			linux_dirent64 *de = (linux_dirent64*)&buf[pos];
+			pos += de->d_reclen;
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+			
+			node *kid = new node(n, de->d_name);
+			struct stat st;
+			if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+				memset(&st, 0, sizeof(st));
+			tree_inode_from_stat(&kid->ti, &st);
+			kid->dev = st.st_dev;
+			if (n->base && S_ISDIR(st.st_mode))
+				kid->base = base_img.lookup(n->base, de->d_name, kid->name.size());
+			if (base_img.hdr && !S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+				pthread_mutex_lock(&scanned_lock);
+				scanned_links.insert(link_key(kid->dev, kid->ti.src_ino));
+				pthread_mutex_unlock(&scanned_lock);
+			}
+			n->kids.push_back(kid);
+		}
+	}
+	if (r < 0)
+		read_error(node_path(n));
+	std::sort(n->kids.begin(), n->kids.end(), node_less);
+	if (stream_out)
+		stream_dir(n);
+	queue_subdirs(w, n, fd);
+}
+
+// Is a directory just as it was in the base image?
+static bool unchanged(node *n) {
+	if (!n->base || n->base >= base_img.hdr->ninodes)
+		return false;
+	const tree_inode& b = base_img.inodes[n->base];
+	const tree_inode& t = n->ti;
+	return S_ISDIR(b.mode) && b.src_ino == t.src_ino
+		&& b.mtime == t.mtime && b.mtime_ns == t.mtime_ns
+		&& b.ctime == t.ctime && b.ctime_ns == t.ctime_ns;
+}
+
+// Take the listing of an unchanged directory from the base image. Only
+// subdirectories are stat'ed, to see whether they've changed in turn.
+// Returns false if the base image is damaged here, and it must be scanned.
+static bool reuse_dir(size_t w, node *n, int fd) {
+	const tree_inode& d = base_img.inodes[n->base];
+	if (!base_img.entries_ok(d))
+		return false;
+	n->kids.reserve(d.count);
+	for (uint64_t i = d.first; i < d.first + d.count; ++i) {
+		uint64_t ino;
+		const char *name;
+		size_t len;
+		if (!base_img.entry(i, &ino, &name, &len)) {
+			for (size_t k = 0; k < n->kids.size(); ++k)
+				delete n->kids[k];
+			n->kids.clear();
+			return false;
+		}
+		const tree_inode& b = base_img.inodes[ino];
+		node *kid = new node(n, string(name, len));
+		if (S_ISDIR(b.mode)) {
+			struct stat st;
+			if (fstatat(fd, kid->name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0)
+				memset(&st, 0, sizeof(st));
+			tree_inode_from_stat(&kid->ti, &st);
+			kid->dev = st.st_dev;
+			kid->base = ino;
+		} else {
+			kid->ti = b;
+			kid->ti.first = kid->ti.count = 0;
+			kid->dev = n->dev;	// Only a directory can be a mount point
+		}
+		n->kids.push_back(kid);
+	}
+	if (stream_out)
+		stream_dir(n);
+	queue_subdirs(w, n, fd);
+	return true;
+}
+
+static void list_dir(size_t w, node *n, int fd) {
+	if (!unchanged(n) || !reuse_dir(w, n, fd))
+		scan_dir(w, n, fd);
+}
+
+static void *scan_worker(void *arg) {
+	size_t w = (size_t)arg;
+	while (true) {
+		node *n = pop_task(w);
+		if (!n) {
+			pthread_mutex_lock(&idle_lock);
+			while (!__sync_fetch_and_add(&queued, 0)
+					&& __sync_fetch_and_add(&unfinished, 0))
+				pthread_cond_wait(&idle_cond, &idle_lock);
+			bool done = !__sync_fetch_and_add(&unfinished, 0);
+			pthread_mutex_unlock(&idle_lock);
+			if (done)
+				return NULL;
+			continue;
+		}
+		
+		int fd = openat(n->parent->fd, n->name.c_str(),
+			O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (fd == -1)
+			read_error(node_path(n));
+		release_dir(n->parent);
+		if (fd != -1)
+			list_dir(w, n, fd);
+		finish_task();
+	}
+}
+
+// Scan the tree below a directory, with the given number of threads
+static void scan(node *root, int fd, unsigned threads) {
+	workers.resize(threads);
+	for (size_t i = 0; i < threads; ++i)
+		pthread_mutex_init(&workers[i].lock, NULL);
+	
+	__sync_fetch_and_add(&unfinished, 1);
+	list_dir(0, root, fd);
+	finish_task();
+	
+	vector<pthread_t> tids(threads);
+	for (size_t i = 1; i < threads; ++i) {
+		if (pthread_create(&tids[i], NULL, scan_worker, (void*)i) != 0)
+			die("pthread_create");
+	}
+	scan_worker((void*)0);
+	for (size_t i = 1; i < threads; ++i)
+		pthread_join(tids[i], NULL);
+}
+
+
+// The image being built, section by section. Inode numbers are handed out
+// when a directory is listed, so each directory's entries get consecutive
+// numbers in name order, except for links to files seen before.
+vector<tree_inode> inodes;
+vector<tree_dirent> dirents;
+string names;
+
+// Files with more than one link, by device and inode, and the inode each
+// has in the image. Its link count becomes the number of links in the tree.
+map<link_key, uint64_t> links;
+
+// Hash indexes of directories with at least hash_min entries. Until the
+// section is placed, a directory's hash field is its offset within it.
+vector<char> hashes;
+vector<size_t> hashed;	// Directories with an index
+uint64_t hash_min = 128;
+const uint32_t hash_seeds = 16;	// Seeds to try before giving up
+
+struct bucket_order {
+	const vector<uint32_t>& size;
+	bucket_order(const vector<uint32_t>& s) : size(s) { }
+	bool operator()(uint32_t a, uint32_t b) const {
+		return size[a] != size[b] ? size[a] > size[b] : a < b;
+	}
+};
+
+// Try to make a minimal perfect hash of a directory's entries, appending it
+// to hashes. Buckets are placed biggest first, each at the first
+// displacement that sends all its names to free slots.
+static bool build_hash(const tree_inode& d, uint32_t seed) {
+	uint64_t n = d.count;
+	uint32_t nbuckets = n / 4 + 1;
+	uint64_t max_tries = n * 64 < UINT32_MAX ? n * 64 : UINT32_MAX;
+	
+	vector<uint64_t> h(n);
+	vector<uint32_t> size(nbuckets), start(nbuckets + 1), members(n);
+	for (uint64_t i = 0; i < n; ++i) {
+		const tree_dirent& de = dirents[d.first + i];
+		h[i] = tree_hash_name(seed, names.data() + de.name_off, de.name_len);
+		++size[tree_hash_bucket(h[i], nbuckets)];
+	}
+	for (uint32_t b = 0; b < nbuckets; ++b)
+		start[b + 1] = start[b] + size[b];
+	vector<uint32_t> fill(start.begin(), start.end() - 1);
+	for (uint64_t i = 0; i < n; ++i)
+		members[fill[tree_hash_bucket(h[i], nbuckets)]++] = i;
+	vector<uint32_t> order(nbuckets);
+	for (uint32_t b = 0; b < nbuckets; ++b)
+		order[b] = b;
+	std::sort(order.begin(), order.end(), bucket_order(size));
+	
+	vector<char> taken(n);
+	vector<uint32_t> disp(nbuckets), pos;
+	vector<tree_hash_slot> slots(n);
+	for (uint32_t o = 0; o < nbuckets && size[order[o]]; ++o) {
+		uint32_t b = order[o];
+		uint64_t t;
+		for (t = 0; t < max_tries; ++t) {
+			pos.clear();
+			for (uint32_t m = start[b]; m < start[b + 1]; ++m) {
+				uint32_t p = tree_hash_slot_of(h[members[m]], t, n);
+				if (taken[p])
+					break;
+				taken[p] = 1;
+				pos.push_back(p);
 			}
-			closedir(d);
+			if (pos.size() == size[b])
+				break;
+			for (size_t k = 0; k < pos.size(); ++k)
+				taken[pos[k]] = 0;
+		}
+		if (t == max_tries)
+			return false;
+		
+		disp[b] = t;
+		for (size_t k = 0; k < pos.size(); ++k) {
+			uint32_t i = members[start[b] + k];
+			slots[pos[k]].entry = i;
+			slots[pos[k]].fingerprint = tree_hash_fingerprint(h[i]);
 		}
 	}
 	
-	st.st_dev = 0;
-	st.st_ino = ino++;
-	write(fd, &st, sizeof(st));
-	if (is_dir) {	
-		vector<entry>::iterator iter(entries.begin());
-		for (; iter != entries.end(); ++iter)
-			iter->write_entry(fd);
-		unsigned short eoe = 0;
-		write(fd, &eoe, sizeof(eoe));
+	tree_hash th;
+	th.seed = seed;
+	th.nbuckets = nbuckets;
+	size_t off = hashes.size();
+	hashes.resize(off + tree_hash_size(nbuckets, n));
+	memcpy(&hashes[off], &th, sizeof(th));
+	memcpy(&hashes[off + sizeof(th)], &disp[0], nbuckets * sizeof(uint32_t));
+	memcpy(&hashes[off + tree_hash_size(nbuckets, 0)], &slots[0],
+		n * sizeof(tree_hash_slot));
+	return true;
+}
+
+// Give a directory a hash index. If no seed works, it does without, and
+// lookups in it use binary search.
+static void index_dir(size_t dino) {
+	for (uint32_t seed = 0; seed < hash_seeds; ++seed) {
+		size_t off = hashes.size();
+		if (build_hash(inodes[dino], seed)) {
+			inodes[dino].hash = off;
+			hashed.push_back(dino);
+			return;
+		}
+	}
+}
+
+void write_path(node *dir, const string &path, size_t dino) {
+	vector<node*>& kids = dir->kids;
+	vector<uint64_t> kid_inos(kids.size());
+	inodes[dino].first = dirents.size();
+	inodes[dino].count = kids.size();
+	for (size_t i = 0; i < kids.size(); ++i) {
+		node *kid = kids[i];
+		uint64_t ino = 0;
+		link_key key(kid->dev, kid->ti.src_ino);
+		bool linked = !S_ISDIR(kid->ti.mode)
+			&& (kid->ti.nlink > 1 || scanned_links.count(key));
+		if (linked) {
+			map<link_key, uint64_t>::iterator iter = links.find(key);
+			if (iter != links.end()) {
+				ino = iter->second;
+				++inodes[ino].nlink;
+			}
+		}
+		if (!ino) {
+			ino = inodes.size();
+			inodes.push_back(kid->ti);
+			if (linked) {
+				links[key] = ino;
+				inodes[ino].nlink = 1;
+			}
+			if (blob_fd != -1 && S_ISREG(kid->ti.mode))
+				store_contents(path + "/" + kid->name, &inodes[ino]);
+		}
+		kid_inos[i] = ino;
+		
+		tree_dirent de;
+		memset(&de, 0, sizeof(de));
+		de.ino = ino;
+		de.name_off = names.size();
+		de.name_len = kid->name.size();
+		dirents.push_back(de);
+		names += kid->name;
 	}
-	return st.st_ino;
+	if (hash_min && kids.size() >= hash_min)
+		index_dir(dino);
+
+	for (size_t i = 0; i < kids.size(); ++i) {
+		if (S_ISDIR(inodes[kid_inos[i]].mode))
+			write_path(kids[i], path + "/" + kids[i]->name, kid_inos[i]);
+	}
+}
+
+// Streaming: each directory is sent as soon as it's listed, and its
+// entries get their inodes then
+pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t stream_inos = 2;	// The next new inode
+uint64_t stream_dirents = 0;
+const size_t stream_frame = 1 << 20;	// About the most to put in a frame
+
+static void write_frame(uint32_t type, const string& payload) {
+	tree_frame f;
+	memset(&f, 0, sizeof(f));
+	f.type = type;
+	f.size = payload.size();
+	f.crc = crc32(0, (const Bytef*)payload.data(), payload.size());
+	stream_out->write(&f, sizeof(f));
+	stream_out->write(payload.data(), payload.size());
+}
+
+static void write_dir_frame(node *n, uint64_t first, uint64_t count,
+		const string& entries) {
+	tree_frame_dir fd;
+	memset(&fd, 0, sizeof(fd));
+	fd.dir = n->ino;
+	fd.total = n->kids.size();
+	fd.first = first;
+	fd.count = count;
+	string payload((const char*)&fd, sizeof(fd));
+	payload += entries;
+	write_frame(TREE_FRAME_DIR, payload);
+}
+
+static void stream_dir(node *n) {
+	pthread_mutex_lock(&stream_lock);
+	vector<node*>& kids = n->kids;
+	string entries;
+	size_t first = 0;
+	for (size_t i = 0; i < kids.size(); ++i) {
+		node *kid = kids[i];
+		tree_frame_entry e;
+		memset(&e, 0, sizeof(e));
+		e.name_len = kid->name.size();
+		
+		// Link counts stay as they are, since the rest of the links
+		// may not have been seen yet
+		link_key key(kid->dev, kid->ti.src_ino);
+		bool linked = !S_ISDIR(kid->ti.mode) && kid->ti.nlink > 1;
+		if (!linked && !S_ISDIR(kid->ti.mode) && base_img.hdr) {
+			pthread_mutex_lock(&scanned_lock);
+			linked = scanned_links.count(key);
+			pthread_mutex_unlock(&scanned_lock);
+		}
+		map<link_key, uint64_t>::iterator iter;
+		if (linked && (iter = links.find(key)) != links.end()) {
+			e.ino = iter->second;
+		} else {
+			e.ino = stream_inos++;
+			e.flags = TREE_ENTRY_NEW;
+			if (linked)
+				links[key] = e.ino;
+		}
+		kid->ino = e.ino;
+		
+		entries.append((const char*)&e, sizeof(e));
+		entries += kid->name;
+		if (e.flags & TREE_ENTRY_NEW)
+			entries.append((const char*)&kid->ti, sizeof(kid->ti));
+		if (entries.size() >= stream_frame) {
+			write_dir_frame(n, first, i + 1 - first, entries);
+			entries.clear();
+			first = i + 1;
+		}
+	}
+	if (first < kids.size() || kids.empty())
+		write_dir_frame(n, first, kids.size() - first, entries);
+	stream_dirents += kids.size();
+	
+	// Send it now, so a reader can use it while the scan goes on
+	stream_out->flush();
+	pthread_mutex_unlock(&stream_lock);
+}
+
+static uint64_t align8(uint64_t off) {
+	return (off + 7) & ~(uint64_t)7;
+}
+
+// Compressed images hold inodes in blocks of about this much, before
+// they're compressed. A block can go over by a record, but stays well under
+// TREE_ZBLOCK_MAX.
+const size_t zblock_size = 64 << 10;
+
+static void write_zblock(output& out, const string& raw, uint64_t first_rec,
+		uint64_t first_ino, uint64_t *off, vector<tree_zblock>& table) {
+	vector<char> z(compressBound(raw.size()));
+	uLongf zlen = z.size();
+	if (compress2((Bytef*)&z[0], &zlen, (const Bytef*)raw.data(), raw.size(),
+			Z_BEST_COMPRESSION) != Z_OK) {
+		errno = ENOMEM;
+		die("compress");
+	}
+	tree_zblock zb;
+	zb.first_rec = first_rec;
+	zb.first_ino = first_ino;
+	zb.off = *off;
+	zb.csize = zlen;
+	zb.usize = raw.size();
+	table.push_back(zb);
+	out.write(&z[0], zlen);
+	*off += zlen;
+}
+
+// Write the root and the entries as compressed blocks of records, starting
+// at offset off in the image, and return the table of them
+static void write_compressed(output& out, uint64_t off,
+		vector<tree_zblock>& table) {
+	string raw;
+	uint64_t first_rec = 0, first_ino = 1, next = 1;
+	uint64_t prev[TREE_ZFIELDS], f[TREE_ZFIELDS];
+	const char *prev_name = "";
+	size_t prev_len = 0;
+	for (uint64_t rec = 0; rec <= dirents.size(); ++rec) {
+		if (raw.empty()) {	// Each block starts afresh
+			first_rec = rec;
+			first_ino = next;
+			memset(prev, 0, sizeof(prev));
+			prev_len = 0;
+		}
+		
+		const char *name = "";
+		size_t len = 0;
+		uint64_t ino = 1;
+		if (rec) {
+			const tree_dirent& de = dirents[rec - 1];
+			name = names.data() + de.name_off;
+			len = de.name_len;
+			ino = de.ino;
+		}
+		size_t shared = 0;
+		while (shared < len && shared < prev_len
+				&& name[shared] == prev_name[shared])
+			++shared;
+		tree_put_varint(raw, shared);
+		tree_put_varint(raw, len - shared);
+		raw.append(name + shared, len - shared);
+		prev_name = name;
+		prev_len = len;
+		
+		if (ino < next) {	// Another link to an inode we've had
+			tree_put_varint(raw, next - ino);
+		} else {
+			tree_put_varint(raw, 0);
+			tree_inode_fields(&inodes[next++], f);
+			for (int k = 0; k < TREE_ZFIELDS; ++k) {
+				tree_put_varint(raw, tree_zigzag(f[k] - prev[k]));
+				prev[k] = f[k];
+			}
+		}
+		
+		if (raw.size() >= zblock_size) {
+			write_zblock(out, raw, first_rec, first_ino, &off, table);
+			raw.clear();
+		}
+	}
+	if (!raw.empty())
+		write_zblock(out, raw, first_rec, first_ino, &off, table);
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-c BLOB] [-j N] [--base OLD] [-z | -s] [-H N] DIR IMAGE\n"
+		"  -c BLOB        Also store file contents, in BLOB\n"
+		"  -j N           Scan with N threads\n"
+		"  -z, --compress Write a compressed image\n"
+		"  -s, --stream   Write the image as a stream, as the tree is\n"
+		"                 scanned. IMAGE may be a pipe, or - for stdout.\n"
+		"  -H, --hash-min N\n"
+		"                 Give directories with at least N entries a hash\n"
+		"                 index, for faster lookups (128). 0 for none.\n"
+		"  -b, --base OLD Copy directories that haven't changed from the\n"
+		"                 image OLD, which must be uncompressed and not a\n"
+		"                 stream. Files changed in place, without their\n"
+		"                 directory changing, won't be noticed. With -s, a\n"
+		"                 new link to a file in such a directory may not\n"
+		"                 be either, if it's scanned after the directory.\n"
+		"Directories that can't be listed, and contents that can't be read\n"
+		"with -c, are left empty or cut short in the image, and the exit\n"
+		"status is 1.\n",
+		prog);
+	exit(-1);
+}
+
+// A whole number for an option, no more than max
+static uint64_t parse_count(const char *prog, const char *s, uint64_t max) {
+	char *end;
+	errno = 0;
+	unsigned long long n = strtoull(s, &end, 10);
+	if (!isdigit((unsigned char)*s) || *end || errno || n > max)
+		usage(prog);
+	return n;
 }
 
 int main(int argc, char *argv[]) {
-	string dir(argv[1]);
-	fd = open(argv[2], O_WRONLY | O_CREAT, 0777);
-	write_path(dir, NULL);
+	static struct option longopts[] = {
+		{ "base", required_argument, NULL, 'b' },
+		{ "hash-min", required_argument, NULL, 'H' },
+		{ "compress", no_argument, NULL, 'z' },
+		{ "stream", no_argument, NULL, 's' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *blob = NULL, *base = NULL;
+	unsigned threads = 1;
+	bool compress = false, stream = false;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "c:j:b:H:zs", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 'c': blob = optarg; break;
+			case 'j': threads = parse_count(argv[0], optarg, 1024); break;
+			case 'b': base = optarg; break;
+			case 'H': hash_min = parse_count(argv[0], optarg, UINT32_MAX); break;
+			case 'z': compress = true; break;
+			case 's': stream = true; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2 || threads < 1)
+		usage(argv[0]);
+	const char *image = argv[optind + 1];
+	if (stream && (blob || compress)) {
+		fprintf(stderr, "A stream can't have file contents, or be compressed\n");
+		exit(-1);
+	}
+	
+	signal(SIGINT, interrupted);
+	signal(SIGTERM, interrupted);
+	signal(SIGHUP, interrupted);
+	
+	output out;
+	if (stream)
+		out.open_stream(image);
+	else
+		out.open(image);
+	if (blob) {
+		blob_out.open(blob);
+		blob_fd = blob_out.fd;
+	}
+
+	if (base) {
+		int fd = open(base, O_RDONLY);
+		if (fd == -1)
+			die(base);
+		// Only an uncompressed image can be copied from, so say if it's
+		// one of the other kinds
+		tree_header h;
+		const char *err = NULL;
+		if (pread(fd, &h, sizeof(h), 0) == sizeof(h)) {
+			if (memcmp(&h, TREE_STREAM_MAGIC, sizeof(TREE_STREAM_MAGIC)) == 0)
+				err = "a stream, and a base must be an uncompressed image";
+			else if (memcmp(h.magic, TREE_MAGIC, sizeof(h.magic)) == 0
+					&& h.version == TREE_ZVERSION)
+				err = "compressed, and a base must be uncompressed";
+		}
+		if (!err)
+			err = base_img.open(fd);
+		if (err) {
+			fprintf(stderr, "%s: %s\n", base, err);
+			remove_outputs();
+			exit(-1);
+		}
+		close(fd);
+	}
+
+	string dir(argv[optind]);
+	struct stat st;
+	if (lstat(dir.c_str(), &st) != 0)
+		die(argv[optind]);
+	node root(NULL, "");
+	tree_inode_from_stat(&root.ti, &st);
+	root.dev = st.st_dev;
+	if (base)
+		root.base = 1;
+	if (stream) {
+		stream_out = &out;
+		root.ino = 1;
+		out.write(TREE_STREAM_MAGIC, sizeof(TREE_STREAM_MAGIC));
+		write_frame(TREE_FRAME_START, string((const char*)&root.ti,
+			sizeof(root.ti)));
+	}
+	if (S_ISDIR(st.st_mode)) {
+		int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+		if (fd == -1)
+			die(argv[optind]);
+		scan_root = dir;
+		scan(&root, fd, threads);
+	}
+	if (stream) {
+		tree_frame_end end;
+		end.ninodes = stream_inos;
+		end.ndirents = stream_dirents;
+		write_frame(TREE_FRAME_END, string((const char*)&end, sizeof(end)));
+		out.commit();
+		return read_errors ? 1 : 0;
+	}
+	
+	inodes.resize(2);
+	inodes[1] = root.ti;
+	write_path(&root, dir, 1);
+
+	tree_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TREE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TREE_VERSION;
+	if (blob_fd != -1) {
+		hdr.flags |= TREE_CONTENT;
+		hdr.blob_size = blob_size;
+	}
+	hdr.ninodes = inodes.size();
+	hdr.ndirents = dirents.size();
+	hdr.names_size = names.size();
+	if (compress) {
+		// The table of blocks goes last, once we know where they are, and
+		// then the header can be filled in
+		hdr.version = TREE_ZVERSION;
+		if (!hashes.empty()) {
+			hdr.hashes_off = sizeof(hdr);
+			hdr.hashes_size = hashes.size();
+			for (size_t i = 0; i < hashed.size(); ++i)
+				inodes[hashed[i]].hash += hdr.hashes_off;
+		}
+		out.write(&hdr, sizeof(hdr));
+		if (!hashes.empty())
+			out.write(&hashes[0], hashes.size());
+		
+		vector<tree_zblock> table;
+		uint64_t off = sizeof(hdr) + hashes.size();
+		write_compressed(out, off, table);
+		off = table.back().off + table.back().csize;
+		char pad[8] = { 0 };
+		out.write(pad, align8(off) - off);
+		hdr.nblocks = table.size();
+		hdr.blocks_off = align8(off);
+		out.write(&table[0], table.size() * sizeof(tree_zblock));
+		out.flush();
+		if (pwrite(out.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			die(image);
+	} else {
+		hdr.inodes_off = sizeof(hdr);
+		hdr.dirents_off = hdr.inodes_off + hdr.ninodes * sizeof(tree_inode);
+		hdr.names_off = hdr.dirents_off + hdr.ndirents * sizeof(tree_dirent);
+		names.resize(align8(names.size()));
+		if (!hashes.empty()) {
+			hdr.hashes_off = hdr.names_off + names.size();
+			hdr.hashes_size = hashes.size();
+			for (size_t i = 0; i < hashed.size(); ++i)
+				inodes[hashed[i]].hash += hdr.hashes_off;
+		}
+		
+		out.write(&hdr, sizeof(hdr));
+		out.write(&inodes[0], inodes.size() * sizeof(tree_inode));
+		if (!dirents.empty())
+			out.write(&dirents[0], dirents.size() * sizeof(tree_dirent));
+		out.write(names.data(), names.size());
+		if (!hashes.empty())
+			out.write(&hashes[0], hashes.size());
+	}
 	
-	return 0;
+	// The image refers to the blob, so the blob goes first
+	if (blob)
+		blob_out.commit();
+	out.commit();
+
+	return read_errors ? 1 : 0;
 }